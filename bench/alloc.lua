@@ -0,0 +1,35 @@
+-- allocation heavy fibers on the main state, with the system allocator,
+-- and on a spawned thread, with its pool allocator. One operation is 8
+-- fibers making 10000 small tables each
+local luv = require("luv")
+
+local N, F = 10000, 8
+
+local work = function(N, F)
+   local luv = require("luv")
+   local fibers = { }
+   for f=1, F do
+      fibers[f] = luv.fiber.create(function()
+         local t
+         for i=1, N do
+            t = { i, tostring(i), { x = i } }
+         end
+         return t
+      end)
+      fibers[f]:ready()
+   end
+   for f=1, F do
+      fibers[f]:join()
+   end
+end
+
+return function(bench)
+   bench.measure("alloc.main", work, N, F)
+
+   -- keep the thread for the whole case, so its pool stays warm
+   local pool = luv.thread.pool(1)
+   bench.measure("alloc.thread", function()
+      pool:submit(work, N, F):join()
+   end)
+   pool:close()
+end
@@ -0,0 +1,97 @@
+-- codec encode and decode over a few message shapes
+local luv = require("luv")
+
+return function(bench)
+   local array = { }
+   for i=1, 1024 do array[i] = i * 1.5 end
+
+   local ints = { }
+   for i=1, 1024 do ints[i] = i % 300 - 20 end
+
+   local records = { }
+   for i=1, 100 do
+      records[i] = { id = i, name = "user"..i, email = "user"..i.."@example.com",
+                     active = i % 2 == 0, score = i * 0.25 }
+   end
+
+   local nested = { }
+   local node = nested
+   for i=1, 16 do
+      node.name = "level"..i
+      node.tags = { "a", "b", "c" }
+      node.next = { }
+      node = node.next
+   end
+
+   local shapes = {
+      { "small",   { id = 1, ok = true } },
+      { "record",  { id = 42, name = "widget", price = 9.99, tags = { "x", "y" },
+                     owner = { name = "ops", uid = 1000 } } },
+      { "array1k", array },
+      { "ints1k",  ints },
+      { "records", records },
+      { "nested",  nested },
+      { "string4k", string.rep("x", 4096) },
+   }
+
+   local encode, decode = luv.codec.encode, luv.codec.decode
+   local encode_into, buf = luv.codec.encode_into, luv.codec.buffer()
+   local checked = luv.codec.decoder()
+   for _, shape in ipairs(shapes) do
+      local name, value = shape[1], shape[2]
+      local str = encode(value)
+      bench.measure("codec.encode."..name, function() encode(value) end)
+      bench.measure("codec.encode_into."..name, function() encode_into(buf, value) end)
+      bench.measure("codec.decode."..name, function() decode(str) end)
+      bench.measure("codec.decode_checked."..name, function() checked(str) end)
+   end
+
+   local many = { }
+   for i=1, 100 do many[i] = encode(i, "item"..i, true) end
+   many = table.concat(many)
+   local decode_many = luv.codec.decode_many
+   bench.measure("codec.decode_many.100", function()
+      for pos, n in decode_many(many) do end
+   end)
+
+   -- a record shape through a schema, against the generic form above
+   local owner = luv.codec.schema{ "name", "uid" }
+   local schema = luv.codec.schema{ "id", "name", "price", "tags", { "owner", owner } }
+   local record = shapes[2][2]
+   local rec = schema:encode(record)
+   bench.measure("codec.schema.encode.record", function() schema:encode(record) end)
+   bench.measure("codec.schema.decode.record", function() schema:decode(rec) end)
+   print(string.format("%-28s generic %4d bytes  schema %4d bytes",
+      "codec.size.record", #encode(record), #rec))
+
+   -- compression, on data which compresses well and data which doesn't
+   local random = { }
+   for i=1, 4096 do random[i] = string.char(math.random(0, 255)) end
+   random = table.concat(random)
+   local encode_z = luv.codec.encoder{ compress = true }
+   for _, shape in ipairs{ shapes[5], shapes[4], { "random4k", random } } do
+      local name, value = shape[1], shape[2]
+      local str, z = encode(value), encode_z(value)
+      bench.measure("codec.z.encode."..name, function() encode_z(value) end)
+      bench.measure("codec.z.decode."..name, function() decode(z) end)
+      print(string.format("%-28s plain %7d bytes  compressed %7d bytes",
+         "codec.z.size."..name, #str, #z))
+   end
+
+   local func = function(a, b) return a + b, shapes end
+   bench.measure("codec.encode.function", function() encode(func) end)
+
+   -- the same shapes in the v1 format, for size and speed against v2
+   local version = luv.codec.version()
+   for _, shape in ipairs(shapes) do
+      local name, value = shape[1], shape[2]
+      luv.codec.version(1)
+      local str = encode(value)
+      bench.measure("codec.v1.encode."..name, function() encode(value) end)
+      bench.measure("codec.v1.decode."..name, function() decode(str) end)
+      luv.codec.version(2)
+      print(string.format("%-28s v1 %7d bytes  v2 %7d bytes",
+         "codec.size."..name, #str, #encode(value)))
+   end
+   luv.codec.version(version)
+end
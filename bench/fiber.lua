@@ -0,0 +1,9 @@
+-- fiber spawn and join
+local luv = require("luv")
+
+return function(bench)
+   local work = function(a) return a end
+   bench.measure("fiber.create_join", function()
+      luv.fiber.create(work, 42):join()
+   end)
+end
@@ -0,0 +1,15 @@
+-- 4KB file writes and reads through the thread pool
+local luv = require("luv")
+
+return function(bench)
+   local path = os.tmpname()
+   local file = luv.fs.open(path, "w+", "664")
+   local block = string.rep("x", 4096)
+   file:write(block, 0)
+
+   bench.measure("fs.write4k", function() file:write(block, 0) end)
+   bench.measure("fs.read4k", function() file:read(4096, 0) end)
+
+   file:close()
+   luv.fs.unlink(path)
+end
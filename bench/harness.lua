@@ -0,0 +1,274 @@
+-- luv benchmark harness, run by the luv_bench driver
+--
+--   luv_bench [-t seconds] [-o results.json] [scenario ...]
+--   luv_bench --compare base.json new.json
+--
+-- Each scenario is a file in this directory returning a function which
+-- is run in a fiber and passed the `bench' table below. It calls
+-- bench.measure(name, fn) for each case, fn performing one operation.
+-- A scenario leaving threads running sets bench.detached, then the
+-- process exits without closing the Lua state.
+
+local luv = require("luv")
+
+local DIR = BENCH_DIR or "bench"
+
+local SCENARIOS = {
+   "sched", "fiber", "codec", "tcp", "pipe", "udp", "fs", "thread", "zmq",
+   "alloc", "snapshot", "serve"
+}
+
+local MAX_SAMPLES = 100000
+
+local unpack = unpack or table.unpack
+
+local function usage()
+   io.stderr:write([[
+usage: luv_bench [-t seconds] [-o results.json] [scenario ...]
+       luv_bench --compare base.json new.json
+scenarios: ]]..table.concat(SCENARIOS, " ").."\n")
+   return 2
+end
+
+------------------------------------------------------------------------
+-- JSON, only as much as our result files need
+------------------------------------------------------------------------
+local function json_encode(val, out)
+   out = out or { }
+   local t = type(val)
+   if t == "table" then
+      if #val > 0 or next(val) == nil then
+         out[#out + 1] = "["
+         for i=1, #val do
+            if i > 1 then out[#out + 1] = "," end
+            out[#out + 1] = "\n  "
+            json_encode(val[i], out)
+         end
+         out[#out + 1] = "\n]"
+      else
+         local keys = { }
+         for k in pairs(val) do keys[#keys + 1] = k end
+         table.sort(keys)
+         out[#out + 1] = "{"
+         for i, k in ipairs(keys) do
+            if i > 1 then out[#out + 1] = ", " end
+            out[#out + 1] = string.format("%q: ", k)
+            json_encode(val[k], out)
+         end
+         out[#out + 1] = "}"
+      end
+   elseif t == "string" then
+      out[#out + 1] = '"'..val:gsub('[%c"\\]', function(c)
+         return string.format("\\u%04x", c:byte())
+      end)..'"'
+   elseif t == "number" then
+      out[#out + 1] = val == math.floor(val) and string.format("%d", val)
+         or string.format("%.6g", val)
+   else
+      out[#out + 1] = tostring(val)
+   end
+   return out
+end
+
+local function json_decode(str)
+   local pos = 1
+   local value
+   local function skip()
+      pos = str:find("[^%s]", pos) or #str + 1
+   end
+   local function fail(what)
+      error(string.format("bad JSON at offset %d: %s", pos, what), 0)
+   end
+   function value()
+      skip()
+      local c = str:sub(pos, pos)
+      if c == "{" then
+         local obj = { }
+         pos = pos + 1
+         skip()
+         if str:sub(pos, pos) == "}" then pos = pos + 1 return obj end
+         repeat
+            skip()
+            local key = value()
+            skip()
+            if str:sub(pos, pos) ~= ":" then fail("expected ':'") end
+            pos = pos + 1
+            obj[key] = value()
+            skip()
+            c = str:sub(pos, pos)
+            pos = pos + 1
+         until c ~= ","
+         if c ~= "}" then fail("expected '}'") end
+         return obj
+      elseif c == "[" then
+         local arr = { }
+         pos = pos + 1
+         skip()
+         if str:sub(pos, pos) == "]" then pos = pos + 1 return arr end
+         repeat
+            arr[#arr + 1] = value()
+            skip()
+            c = str:sub(pos, pos)
+            pos = pos + 1
+         until c ~= ","
+         if c ~= "]" then fail("expected ']'") end
+         return arr
+      elseif c == '"' then
+         local s, e = str:find('^"[^"]*"', pos)
+         if not s then fail("unterminated string") end
+         pos = e + 1
+         return (str:sub(s + 1, e - 1):gsub("\\u(%x%x%x%x)", function(h)
+            return string.char(tonumber(h, 16))
+         end))
+      else
+         local lit = str:match("^[%w%.%+%-]+", pos)
+         if not lit then fail("unexpected '"..c.."'") end
+         pos = pos + #lit
+         if lit == "true" then return true end
+         if lit == "false" then return false end
+         if lit == "null" then return nil end
+         return tonumber(lit) or fail("bad number '"..lit.."'")
+      end
+   end
+   return value()
+end
+
+local function read_file(path)
+   local fh = assert(io.open(path, "rb"))
+   local data = fh:read("*a")
+   fh:close()
+   return data
+end
+
+------------------------------------------------------------------------
+-- measuring
+------------------------------------------------------------------------
+local bench = { seconds = 1, warmup = 0.1, results = { } }
+
+local function percentile(sorted, p)
+   if #sorted == 0 then return 0 end
+   local i = math.ceil(p * #sorted)
+   if i < 1 then i = 1 end
+   return sorted[i]
+end
+
+function bench.measure(name, fn, ...)
+   local warm = luv.hrtime() + bench.warmup * 1e9
+   while luv.hrtime() < warm do fn(...) end
+
+   local samples, ops = { }, 0
+   local start = luv.hrtime()
+   local stop  = start + bench.seconds * 1e9
+   local now   = start
+   while now < stop do
+      fn(...)
+      local t = luv.hrtime()
+      ops = ops + 1
+      if ops <= MAX_SAMPLES then
+         samples[ops] = t - now
+      else
+         -- keep a uniform sample of the latencies
+         local j = math.random(ops)
+         if j <= MAX_SAMPLES then samples[j] = t - now end
+      end
+      now = t
+   end
+   table.sort(samples)
+
+   local secs = (now - start) / 1e9
+   local result = {
+      name        = name,
+      ops         = ops,
+      seconds     = secs,
+      ops_per_sec = ops / secs,
+      p50_us      = percentile(samples, 0.50) / 1e3,
+      p99_us      = percentile(samples, 0.99) / 1e3,
+      rss_kb      = bench_rss and bench_rss() or 0,
+   }
+   bench.results[#bench.results + 1] = result
+   print(string.format("%-28s %12.0f ops/s  p50 %9.2f us  p99 %9.2f us  rss %7d KB",
+      name, result.ops_per_sec, result.p50_us, result.p99_us, result.rss_kb))
+   return result
+end
+
+------------------------------------------------------------------------
+-- compare mode
+------------------------------------------------------------------------
+local function compare(base_path, new_path)
+   local base = json_decode(read_file(base_path))
+   local new  = json_decode(read_file(new_path))
+   local index = { }
+   for _, r in ipairs(base.results) do index[r.name] = r end
+
+   print(string.format("%-28s %12s %12s %8s %10s %10s",
+      "name", "base ops/s", "new ops/s", "delta", "base p99", "new p99"))
+   for _, r in ipairs(new.results) do
+      local b = index[r.name]
+      if b then
+         local delta = (r.ops_per_sec - b.ops_per_sec) / b.ops_per_sec * 100
+         print(string.format("%-28s %12.0f %12.0f %+7.1f%% %8.2fus %8.2fus",
+            r.name, b.ops_per_sec, r.ops_per_sec, delta, b.p99_us, r.p99_us))
+         index[r.name] = nil
+      else
+         print(string.format("%-28s %12s %12.0f", r.name, "-", r.ops_per_sec))
+      end
+   end
+   for _, b in ipairs(base.results) do
+      if index[b.name] then
+         print(string.format("%-28s %12.0f %12s", b.name, b.ops_per_sec, "-"))
+      end
+   end
+   return 0
+end
+
+------------------------------------------------------------------------
+-- main
+------------------------------------------------------------------------
+local function main(...)
+   local args = { ... }
+   local out, only = nil, { }
+   local i = 1
+   while i <= #args do
+      local a = args[i]
+      if a == "--compare" then
+         if not (args[i + 1] and args[i + 2]) then return usage() end
+         return compare(args[i + 1], args[i + 2])
+      elseif a == "-o" then
+         out = args[i + 1]
+         if not out then return usage() end
+         i = i + 1
+      elseif a == "-t" then
+         local secs = tonumber(args[i + 1])
+         if not secs or secs <= 0 then return usage() end
+         bench.seconds = secs
+         i = i + 1
+      elseif a == "-h" or a == "--help" then
+         return usage()
+      else
+         only[#only + 1] = a
+      end
+      i = i + 1
+   end
+   if #only == 0 then only = SCENARIOS end
+
+   for _, name in ipairs(only) do
+      local scenario = dofile(DIR.."/"..name..".lua")
+      local fiber = luv.fiber.create(scenario, bench)
+      fiber:join()
+   end
+
+   if out then
+      local fh = assert(io.open(out, "w"))
+      fh:write(table.concat(json_encode({
+         luv_bench = 1,
+         version   = _VERSION,
+         seconds   = bench.seconds,
+         results   = bench.results,
+      })), "\n")
+      fh:close()
+   end
+   if bench.detached then os.exit(0) end
+   return 0
+end
+
+return main(unpack(arg or { }))
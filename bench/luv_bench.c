@@ -0,0 +1,92 @@
+/* luv_bench - runs the benchmark scenarios in bench/ against a luv
+** statically linked into an embedded Lua state, see bench/harness.lua */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+#ifndef LUV_BENCH_DIR
+#define LUV_BENCH_DIR "bench"
+#endif
+
+LUALIB_API int luaopen_luv(lua_State *L);
+
+/* peak resident set size in KB */
+static int bench_rss(lua_State* L) {
+#ifdef _WIN32
+  lua_pushnumber(L, 0);
+#else
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  lua_pushnumber(L, (lua_Number)ru.ru_maxrss / 1024);
+#else
+  lua_pushnumber(L, (lua_Number)ru.ru_maxrss);
+#endif
+#endif
+  return 1;
+}
+
+static int bench_traceback(lua_State* L) {
+  luaL_traceback(L, L, lua_tostring(L, 1), 1);
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  const char* dir = getenv("LUV_BENCH_DIR");
+  lua_State* L;
+  int i, rv;
+
+  if (!dir) dir = LUV_BENCH_DIR;
+
+  L = luaL_newstate();
+  luaL_openlibs(L);
+
+  /* require("luv") resolves to the linked in module */
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "preload");
+  lua_pushcfunction(L, luaopen_luv);
+  lua_setfield(L, -2, "luv");
+  lua_pop(L, 2);
+
+  lua_pushcfunction(L, bench_rss);
+  lua_setglobal(L, "bench_rss");
+  lua_pushstring(L, dir);
+  lua_setglobal(L, "BENCH_DIR");
+
+  lua_createtable(L, argc, 0);
+  for (i = 0; i < argc; i++) {
+    lua_pushstring(L, argv[i]);
+    lua_rawseti(L, -2, i);
+  }
+  lua_setglobal(L, "arg");
+
+  lua_pushcfunction(L, bench_traceback);
+  lua_pushfstring(L, "%s/harness.lua", dir);
+  if (luaL_loadfile(L, lua_tostring(L, -1))) {
+    fprintf(stderr, "luv_bench: %s\n", lua_tostring(L, -1));
+    lua_close(L);
+    return 2;
+  }
+  lua_remove(L, -2);
+
+  rv = lua_pcall(L, 0, 1, -2);
+  if (rv) {
+    fprintf(stderr, "luv_bench: %s\n", lua_tostring(L, -1));
+    lua_close(L);
+    return 2;
+  }
+  rv = lua_isnumber(L, -1) ? (int)lua_tointeger(L, -1) : 0;
+
+  lua_close(L);
+  return rv;
+}
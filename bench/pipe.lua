@@ -0,0 +1,42 @@
+-- 4KB echo round trips over a local pipe
+local luv = require("luv")
+
+return function(bench)
+   local path = os.tmpname()
+   os.remove(path)
+
+   local server = luv.pipe.create()
+   server:bind(path)
+   server:listen()
+
+   local echo = luv.fiber.create(function()
+      local conn = luv.pipe.create()
+      server:accept(conn)
+      while true do
+         local got, str = conn:read(65536)
+         if not got then break end
+         conn:write(str)
+      end
+      conn:close()
+   end)
+   echo:ready()
+
+   local client = luv.pipe.create()
+   client:connect(path)
+   coroutine.yield() -- let the connect complete
+
+   local size = 4096
+   local msg = string.rep("x", size)
+   bench.measure("pipe.echo4k", function()
+      client:write(msg)
+      local got = 0
+      while got < size do
+         got = got + client:read(65536)
+      end
+   end)
+
+   client:close()
+   echo:join()
+   server:close()
+   os.remove(path)
+end
@@ -0,0 +1,13 @@
+-- scheduler round trips: a peer fiber yields back every time we do
+local luv = require("luv")
+
+return function(bench)
+   local running = true
+   local peer = luv.fiber.create(function()
+      while running do coroutine.yield() end
+   end)
+   peer:ready()
+   bench.measure("sched.yield", coroutine.yield)
+   running = false
+   peer:join()
+end
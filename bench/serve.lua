@@ -0,0 +1,62 @@
+-- accepts and 64 byte echo requests against luv.net.serve with 1, 2 and
+-- 4 server threads sharing a port, and against luv.net.dispatch with as
+-- many workers behind one acceptor. One operation is a round of 4
+-- client threads making 50 connections each, or 500 requests each on
+-- one connection. The server threads run until the process exits
+local luv = require("luv")
+
+local PORT = tonumber(os.getenv("LUV_BENCH_SERVE_PORT")) or 18000
+
+local CLIENTS = 4
+local CONNS   = 50
+local REQS    = 500
+
+local handler = function(client)
+   while true do
+      local got, str = client:read()
+      if not got then break end
+      client:write(str)
+   end
+   client:close()
+end
+
+local client = function(port, conns, reqs)
+   local luv = require("luv")
+   local msg = string.rep("x", 64)
+   for i=1, conns do
+      local conn = luv.net.tcp()
+      conn:connect("127.0.0.1", port)
+      for j=1, reqs do
+         conn:write(msg)
+         conn:read()
+      end
+      conn:close()
+   end
+end
+
+local function round(port, conns, reqs)
+   local threads = { }
+   for i=1, CLIENTS do
+      threads[i] = luv.thread.spawn(client, port, conns, reqs)
+   end
+   for i=1, CLIENTS do
+      threads[i]:join()
+   end
+end
+
+return function(bench)
+   local port = PORT
+   for _, kind in ipairs{ "serve", "dispatch" } do
+      for _, n in ipairs{ 1, 2, 4 } do
+         port = port + 1
+         luv.net[kind](n, "127.0.0.1", port, handler)
+         luv.sleep(0.1) -- let the listeners come up
+         bench.measure(string.format("%s.%d.accept%d", kind, n, CLIENTS * CONNS),
+            round, port, CONNS, 0)
+         bench.measure(string.format("%s.%d.echo%d", kind, n, CLIENTS * REQS),
+            round, port, 1, REQS)
+      end
+   end
+   -- closing the state would free the loops of the running servers
+   bench.detached = true
+end
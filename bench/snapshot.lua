@@ -0,0 +1,43 @@
+-- loading a lookup table of 20000 records from a snapshot, eagerly and
+-- lazily with a few lookups, against reading a codec message from a file
+-- and decoding it
+local luv = require("luv")
+
+local N = 20000
+
+local function key(i)
+   return "10."..(i % 256).."."..math.floor(i / 256 % 256).."."..i
+end
+
+return function(bench)
+   local snap  = os.tmpname()
+   local codec = os.tmpname()
+   local routes = { }
+   for i=1, N do
+      routes[key(i)] = {
+         id = i, name = "route"..i, weight = i % 7, tags = { "edge", "v4" }
+      }
+   end
+   luv.codec.dump_file(snap, routes)
+   local fh = assert(io.open(codec, "wb"))
+   fh:write(luv.codec.encode(routes))
+   fh:close()
+   routes = nil
+
+   bench.measure("snapshot.decode", function()
+      local fh = io.open(codec, "rb")
+      local str = fh:read("*a")
+      fh:close()
+      return luv.codec.decode(str)
+   end)
+   bench.measure("snapshot.load", luv.codec.load_file, snap)
+   bench.measure("snapshot.lazy_lookup100", function()
+      local routes = luv.codec.load_file(snap, true)
+      for i=1, 100 do
+         assert(routes[key(i)].id == i)
+      end
+   end)
+
+   os.remove(snap)
+   os.remove(codec)
+end
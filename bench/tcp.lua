@@ -0,0 +1,108 @@
+-- 64 byte echo round trips over loopback TCP, and codec message round
+-- trips with send/recv against the same framing done in Lua
+local luv = require("luv")
+
+local PORT = tonumber(os.getenv("LUV_BENCH_PORT")) or 18080
+
+local function u32(n)
+   return string.char(
+      math.floor(n / 16777216) % 256, math.floor(n / 65536) % 256,
+      math.floor(n / 256) % 256, n % 256
+   )
+end
+
+-- read one length prefixed message, `buf' holds what was read past it
+local function lua_recv(conn, buf)
+   while true do
+      if #buf >= 4 then
+         local a, b, c, d = buf:byte(1, 4)
+         local len = ((a * 256 + b) * 256 + c) * 256 + d
+         if #buf >= len + 4 then
+            return buf:sub(5, len + 4), buf:sub(len + 5)
+         end
+      end
+      local got, str = conn:read()
+      if not got then return nil end
+      buf = buf..str
+   end
+end
+
+local function lua_send(conn, ...)
+   local msg = luv.codec.encode(...)
+   conn:write(u32(#msg)..msg)
+end
+
+return function(bench)
+   local server = luv.net.tcp()
+   server:bind("127.0.0.1", PORT)
+   server:listen()
+
+   local echo = luv.fiber.create(function()
+      local conn = luv.net.tcp()
+      server:accept(conn)
+      while true do
+         local got, str = conn:read()
+         if not got then break end
+         conn:write(str)
+      end
+      conn:close()
+
+      conn = luv.net.tcp()
+      server:accept(conn)
+      while true do
+         local ok, a, b, c = conn:recv()
+         if not ok then break end
+         conn:send(ok, a, b, c)
+      end
+      conn:close()
+
+      conn = luv.net.tcp()
+      server:accept(conn)
+      local buf = ""
+      while true do
+         local msg
+         msg, buf = lua_recv(conn, buf)
+         if not msg then break end
+         lua_send(conn, luv.codec.decode(msg))
+      end
+      conn:close()
+   end)
+   echo:ready()
+
+   local client = luv.net.tcp()
+   client:connect("127.0.0.1", PORT)
+   client:nodelay(true)
+
+   local msg = string.rep("x", 64)
+   bench.measure("tcp.echo64", function()
+      client:write(msg)
+      client:read()
+   end)
+   client:close()
+
+   local rec = { id = 42, name = "luv", tags = { "a", "b", "c" } }
+
+   client = luv.net.tcp()
+   client:connect("127.0.0.1", PORT)
+   client:nodelay(true)
+   bench.measure("tcp.msg.send_recv", function()
+      client:send(true, 1234, "hello", rec)
+      client:recv()
+   end)
+   client:close()
+
+   client = luv.net.tcp()
+   client:connect("127.0.0.1", PORT)
+   client:nodelay(true)
+   local buf = ""
+   bench.measure("tcp.msg.lua_framing", function()
+      lua_send(client, true, 1234, "hello", rec)
+      local got
+      got, buf = lua_recv(client, buf)
+      luv.codec.decode(got)
+   end)
+   client:close()
+
+   echo:join()
+   server:close()
+end
@@ -0,0 +1,43 @@
+-- OS thread spawn and join, and the same task on a thread pool, with the
+-- codec's function cache on and off. The task is big enough for its dump
+-- to matter
+local luv = require("luv")
+
+return function(bench)
+   local work = function(a, b)
+      local t = { }
+      for i=1, 16 do
+         t[i] = a * i + b
+      end
+      local s = 0
+      for i=1, #t do
+         if t[i] % 2 == 0 then s = s + t[i] else s = s - t[i] end
+      end
+      return s
+   end
+   local pool = luv.thread.pool(4)
+
+   for _, cache in ipairs{ true, false } do
+      local suffix = cache and "" or ".nocache"
+      luv.codec.cache(cache)
+      bench.measure("thread.spawn_join"..suffix, function()
+         luv.thread.spawn(work, 42, 1):join()
+      end)
+      bench.measure("thread.pool_submit_join"..suffix, function()
+         pool:submit(work, 42, 1):join()
+      end)
+   end
+   luv.codec.cache(true)
+
+   -- 100 tasks in flight at once, so the workers don't wait on us
+   local tasks = { }
+   bench.measure("thread.pool_batch100", function()
+      for i=1, 100 do
+         tasks[i] = pool:submit(work, i, 1)
+      end
+      for i=1, 100 do
+         tasks[i]:join()
+      end
+   end)
+   pool:close()
+end
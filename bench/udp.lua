@@ -0,0 +1,32 @@
+-- 512 byte datagrams over loopback; recv drops datagrams nobody waits
+-- for, so this measures the send side with a receiver draining
+local luv = require("luv")
+
+local PORT = tonumber(os.getenv("LUV_BENCH_PORT")) or 18080
+
+return function(bench)
+   local recv = luv.net.udp()
+   recv:bind("127.0.0.1", PORT + 1)
+
+   local count = 0
+   local running = true
+   local drain = luv.fiber.create(function()
+      while running do
+         recv:recv()
+         count = count + 1
+      end
+   end)
+   drain:ready()
+
+   local send = luv.net.udp()
+   send:bind("127.0.0.1", 0)
+
+   local msg = string.rep("x", 512)
+   bench.measure("udp.send512", function()
+      send:send("127.0.0.1", PORT + 1, msg)
+   end)
+
+   running = false
+   send:send("127.0.0.1", PORT + 1, "done")
+   drain:join()
+end
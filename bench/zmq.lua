@@ -0,0 +1,33 @@
+-- ØMQ inproc PAIR round trips between two fibers, if built with ØMQ
+local luv = require("luv")
+
+return function(bench)
+   if not luv.zmq then return end
+
+   local ctx = luv.zmq.create(1)
+   local a = ctx:socket(luv.zmq.PAIR)
+   a:bind("inproc://bench")
+
+   local b = ctx:socket(luv.zmq.PAIR)
+   b:connect("inproc://bench")
+
+   local echo = luv.fiber.create(function()
+      while true do
+         local msg = b:recv()
+         if msg == "done" then break end
+         b:send(msg)
+      end
+   end)
+   echo:ready()
+
+   local msg = string.rep("x", 64)
+   bench.measure("zmq.pair64", function()
+      a:send(msg)
+      a:recv()
+   end)
+
+   a:send("done")
+   echo:join()
+   a:close()
+   b:close()
+end
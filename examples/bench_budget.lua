@@ -0,0 +1,54 @@
+local luv = require("luv")
+
+-- CPU-bound fibers spinning on coroutine.yield() next to a timer fiber:
+-- reports how late the timer ticks are and the yield throughput for a
+-- few scheduler budgets
+
+local SPIN = 2000000
+
+local function bench(config)
+   luv.scheduler.config(config)
+
+   local yields = 0
+   local spin = function()
+      for i=1, SPIN do
+         yields = yields + 1
+         coroutine.yield()
+      end
+   end
+
+   local late = 0
+   local ticks = 0
+   local tick = luv.fiber.create(function()
+      local timer = luv.timer.create()
+      timer:start(1, 1)
+      local prev = luv.hrtime()
+      for i=1, 50 do
+         timer:wait()
+         local now = luv.hrtime()
+         late = math.max(late, (now - prev) / 1e6 - 1)
+         prev = now
+         ticks = ticks + 1
+      end
+      timer:stop()
+   end)
+
+   local t0 = luv.hrtime()
+   local f1 = luv.fiber.create(spin)
+   local f2 = luv.fiber.create(spin)
+   tick:ready()
+   f1:ready()
+   f2:ready()
+   f1:join()
+   f2:join()
+   local t1 = luv.hrtime()
+   tick:join()
+
+   print(string.format("budget %-6d slice %-6d %.0f yields/sec, max tick lag %.1f ms",
+      config.budget or 0, config.slice or 0, yields / ((t1 - t0) / 1e9), late))
+end
+
+bench{ budget = 0, slice = 0 }
+bench{ budget = 64, slice = 0 }
+bench{ budget = 1024, slice = 0 }
+bench{ budget = 0, slice = 500 }
@@ -0,0 +1,48 @@
+local luv = require("luv")
+
+-- messages/sec between two threads, through a channel and through a
+-- ØMQ inproc PAIR socket
+
+local N = 1000000
+
+local function bench_chan(cap)
+   local chan = luv.chan(cap)
+   local t0 = luv.hrtime()
+   local cons = luv.thread.spawn(function()
+      for i=1, N do
+         chan:get()
+      end
+   end)
+   for i=1, N do
+      chan:put("tick: "..i)
+   end
+   cons:join()
+   local t1 = luv.hrtime()
+   print(string.format("chan(%-5d) %.0f msgs/sec", cap, N / ((t1 - t0) / 1e9)))
+end
+
+local function bench_zmq()
+   local zmq = luv.zmq.create(1)
+   local pub = zmq:socket(luv.zmq.PAIR)
+   pub:bind('inproc://bench')
+   local t0 = luv.hrtime()
+   local cons = luv.thread.spawn(function()
+      local sub = zmq:socket(luv.zmq.PAIR)
+      sub:connect('inproc://bench')
+      for i=1, N do
+         sub:recv()
+      end
+      sub:close()
+   end)
+   for i=1, N do
+      pub:send("tick: "..i)
+   end
+   cons:join()
+   local t1 = luv.hrtime()
+   pub:close()
+   print(string.format("zmq inproc  %.0f msgs/sec", N / ((t1 - t0) / 1e9)))
+end
+
+bench_chan(64)
+bench_chan(4096)
+if luv.zmq then bench_zmq() end
@@ -0,0 +1,27 @@
+local luv = require("luv")
+
+-- fibers spawned and joined per second, with and without recycling
+
+local N = 1000000
+
+local work = function(a)
+   return a
+end
+
+local function bench(size)
+   luv.fiber.pool(size)
+   collectgarbage()
+   local t0 = luv.hrtime()
+   for i=1, N do
+      local f = luv.fiber.create(work, i)
+      f:join()
+   end
+   local t1 = luv.hrtime()
+   local _, pooled = luv.fiber.pool()
+   print(string.format("pool %-5d %.0f fibers/sec (%d pooled)",
+      size, N / ((t1 - t0) / 1e9), pooled))
+end
+
+bench(0)
+bench(1024)
+bench(0)
@@ -0,0 +1,44 @@
+local luv = require("luv")
+
+-- resume latency per priority level with bulk work at every level
+
+local N = 20000
+local LEVELS = { 0, 4, 7 }
+
+local function p99(samples)
+   table.sort(samples)
+   return samples[math.ceil(#samples * 0.99)]
+end
+
+local function bench(aging)
+   luv.scheduler.config{ aging = aging }
+
+   local lat = { }
+   local fibers = { }
+   for _, prio in ipairs(LEVELS) do
+      local samples = { }
+      lat[prio] = samples
+      for j=1, 4 do
+         local f = luv.fiber.create(function()
+            for i=1, N do
+               local t0 = luv.hrtime()
+               coroutine.yield()
+               samples[#samples + 1] = luv.hrtime() - t0
+            end
+         end)
+         f:priority(prio)
+         fibers[#fibers + 1] = f
+      end
+   end
+
+   for _, f in ipairs(fibers) do f:ready() end
+   for _, f in ipairs(fibers) do f:join() end
+
+   for _, prio in ipairs(LEVELS) do
+      print(string.format("aging %-3d priority %d: p99 %.1f us",
+         aging, prio, p99(lat[prio]) / 1e3))
+   end
+end
+
+bench(0)
+bench(16)
@@ -0,0 +1,23 @@
+local luv = require("luv")
+
+-- measures the cost of looking up the running state, which every I/O
+-- call pays: joining a dead fiber does little else besides that lookup
+
+local N = 1000000
+
+local dead = luv.fiber.create(function() end)
+dead:join()
+
+local function bench(where)
+   local t0 = luv.hrtime()
+   for i=1, N do
+      dead:join()
+   end
+   local t1 = luv.hrtime()
+   print(string.format("%-6s %d calls, %.1f ns/call", where, N, (t1 - t0) / N))
+end
+
+bench("main")
+
+local f1 = luv.fiber.create(bench, "fiber")
+f1:join()
@@ -0,0 +1,38 @@
+local luv = require("luv")
+
+-- N fibers sleeping concurrently for random periods of up to a second:
+-- reports the time to start them, to wake them all and how late the
+-- wake ups were, with and without timer slack
+
+local N = tonumber(arg and arg[1]) or 1000000
+
+local function bench(slack)
+   luv.scheduler.config{ slack = slack }
+
+   local late, woken = 0, 0
+   local sleeper = function(secs)
+      local t0 = luv.hrtime()
+      luv.sleep(secs)
+      late  = late + ((luv.hrtime() - t0) / 1e6 - secs * 1000)
+      woken = woken + 1
+   end
+
+   local t0 = luv.hrtime()
+   local fibers = { }
+   for i=1, N do
+      local f = luv.fiber.create(sleeper, math.random(1000) / 1000)
+      f:ready()
+      fibers[i] = f
+   end
+   local t1 = luv.hrtime()
+   for i=1, N do
+      fibers[i]:join()
+   end
+   local t2 = luv.hrtime()
+
+   print(string.format("slack %-3d %d sleepers, start %.0f ms, all done %.0f ms, avg lag %.2f ms",
+      slack, woken, (t1 - t0) / 1e6, (t2 - t0) / 1e6, late / woken))
+end
+
+bench(0)
+bench(16)
@@ -50,3 +50,61 @@ assert(obj.a.b)
 assert(obj.a.b.c == obj.a.b)
 
 
+
+-- values after a __codec table refer back to it by number
+local str = luv.codec.encode({ luv, luv, "after" })
+local dec = luv.codec.decode(str)
+assert(dec[1] == dec[2])
+assert(type(dec[1].codec) == "table")
+assert(dec[3] == "after")
+
+local function f() return luv end
+local dec = luv.codec.decode(luv.codec.encode({ luv, f, luv }))
+assert(dec[1] == dec[3])
+assert(dec[2]() == dec[1])
+
+-- a length running off either end of the data is refused
+local str = luv.codec.encode("range")
+assert(not pcall(luv.codec.decode, str, 1, -1))
+assert(not pcall(luv.codec.decoder(), str, 1, -1))
+assert(not pcall(luv.codec.decode, str, 1, #str + 1))
+assert(luv.codec.decode(str, 1, #str) == "range")
+
+-- __codec hooks count against the decoder's depth like tables do
+reg["example:wrap"] = function(v) return { v } end
+local function wrap(v)
+   return setmetatable({ }, { __codec = function() return "example:wrap", v end })
+end
+local deep = "core"
+for i = 1, 40 do deep = wrap(deep) end
+local str = luv.codec.encode(deep)
+local ok, err = pcall(luv.codec.decoder{ hooks = true }, str)
+assert(not ok and err:find("nested too deeply"))
+assert(luv.codec.decoder{ hooks = true, depth = 64 }(str)[1][1])
+
+-- unread lazy snapshot tables are filled before they are encoded
+local path = os.tmpname()
+luv.codec.dump_file(path, { list = { 1, 2, 3 }, name = "snap" })
+local lazy = luv.codec.load_file(path, true)
+local dec = luv.codec.decode(luv.codec.encode(lazy))
+assert(dec.name == "snap" and #dec.list == 3)
+luv.codec.dump_file(path, luv.codec.load_file(path, true))
+assert(luv.codec.load_file(path).list[3] == 3)
+os.remove(path)
+
+-- buffers refuse a negative size
+assert(not pcall(luv.codec.buffer, -1))
+assert(luv.codec.encode_into(luv.codec.buffer(16), "x") > 0)
+
+-- a run of format 1 messages may hold empty ones
+luv.codec.version(1)
+local run = luv.codec.encode("first")..luv.codec.encode()..luv.codec.encode(7)
+  ..luv.codec.encode()..luv.codec.encode(1, 2)
+luv.codec.version(2)
+local got = { }
+for pos, a, b in luv.codec.decode_many(run) do
+   got[#got + 1] = { a, b }
+end
+assert(#got == 5)
+assert(got[1][1] == "first" and got[2][1] == nil and got[3][1] == 7)
+assert(got[4][1] == nil and got[5][1] == 1 and got[5][2] == 2)
@@ -0,0 +1,32 @@
+local luv = require("luv")
+
+-- a ticking timer fiber next to a fiber hogging the CPU now and then:
+-- the watchdog reports the stalls and luv.loop.lag() shows the spread
+
+luv.loop.watchdog(50)
+
+local ticker = luv.fiber.create(function()
+   local timer = luv.timer.create()
+   timer:start(1, 1)
+   for i=1, 500 do timer:wait() end
+   timer:stop()
+end)
+
+local hog = luv.fiber.create(function()
+   for i=1, 5 do
+      luv.sleep(0.05)
+      local t0 = luv.hrtime()
+      while luv.hrtime() - t0 < 80e6 do end
+   end
+end)
+
+ticker:ready()
+hog:ready()
+ticker:join()
+hog:join()
+
+local lag = luv.loop.lag()
+print(string.format("%d turns, mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms, %d stalls",
+   lag.count, lag.mean, lag.p50, lag.p99, lag.max, lag.stalls))
+
+luv.loop.watchdog()
@@ -0,0 +1,32 @@
+local luv = require("luv")
+
+-- profiles two CPU-bound fibers and a sleeper, then prints the folded
+-- stacks, pipe the output through flamegraph.pl to get a picture
+
+local function fib(n)
+   if n < 2 then return n end
+   return fib(n - 1) + fib(n - 2)
+end
+
+local function busy(n)
+   for i=1, 20 do
+      fib(n)
+      coroutine.yield()
+   end
+end
+
+luv.profiler.start(tonumber(arg and arg[1]) or 1000)
+
+local f1 = luv.fiber.create(busy, 24)
+local f2 = luv.fiber.create(busy, 22)
+local f3 = luv.fiber.create(function()
+   for i=1, 10 do luv.sleep(0.01) end
+end)
+f1:ready()
+f2:ready()
+f3:ready()
+f1:join()
+f2:join()
+f3:join()
+
+io.write(luv.profiler.stop())
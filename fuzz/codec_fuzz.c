@@ -0,0 +1,59 @@
+/* libFuzzer target for the checked codec decoder, build with clang:
+**
+**   cmake -DUSE_FUZZ=ON -DCMAKE_C_COMPILER=clang . && make luv_codec_fuzz
+**   ./luv_codec_fuzz -max_len=4096 corpus/
+**
+** Each input is decoded as a run of messages, as read from a socket. Its
+** first byte turns on __codec hooks when odd, with an identity decoder
+** registered as "fuzz". */
+
+#include "../src/luv.h"
+
+static lua_State* L = NULL;
+
+static int fuzz_hook(lua_State* L) {
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int fuzz_decode(lua_State* L) {
+  const char* data = (const char*)lua_touserdata(L, 1);
+  size_t len  = (size_t)lua_tointeger(L, 2);
+  size_t used = 0;
+  luv_codec_opts_t opts;
+
+  opts.depth     = LUV_CODEC_DEPTH;
+  opts.size      = LUV_CODEC_SIZE;
+  opts.functions = 0;
+  opts.hooks     = 0;
+
+  if (len) {
+    opts.hooks = *data & 1;
+    data++;
+    len--;
+  }
+
+  while (len) {
+    lua_settop(L, 2);
+    luvL_codec_decode_from(L, data, len, &used, &opts);
+    data += used;
+    len  -= used;
+  }
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  if (!L) {
+    L = luaL_newstate();
+    luaL_openlibs(L);
+    lua_pushcfunction(L, fuzz_hook);
+    lua_setfield(L, LUA_REGISTRYINDEX, "fuzz");
+  }
+  lua_pushcfunction(L, fuzz_decode);
+  lua_pushlightuserdata(L, (void*)data);
+  lua_pushinteger(L, (lua_Integer)size);
+  lua_pcall(L, 2, 0, 0); /* errors are expected, crashes are not */
+  lua_settop(L, 0);
+  lua_gc(L, LUA_GCSTEP, 0);
+  return 0;
+}
@@ -91,17 +91,16 @@ uv_loop_t* luvL_event_loop(lua_State* L) {
   return luvL_state_self(L)->loop;
 }
 
-static void _sleep_cb(uv_timer_t* handle, int status) {
-  luvL_state_ready((luv_state_t*)handle->data);
-  free(handle);
+static void _sleep_cb(luv_timeout_t* timeout) {
+  luvL_state_ready((luv_state_t*)timeout->data);
 }
 static int luv_sleep(lua_State* L) {
   lua_Number timeout = luaL_checknumber(L, 1);
   luv_state_t* state = luvL_state_self(L);
-  uv_timer_t*  timer = (uv_timer_t*)malloc(sizeof(uv_timer_t));
-  timer->data = state;
-  uv_timer_init(luvL_event_loop(L), timer);
-  uv_timer_start(timer, _sleep_cb, (long)(timeout * 1000), 0L);
+  if (timeout < 0) timeout = 0;
+  luvL_timeout_init(&state->sleep, &luvL_thread_self(L)->wheel, _sleep_cb);
+  state->sleep.data = state;
+  luvL_timeout_start(&state->sleep, (uint64_t)(timeout * 1000), 0);
   return luvL_state_suspend(state);
 }
 
@@ -321,6 +320,12 @@ LUALIB_API int luaopen_luv(lua_State *L) {
   lua_pushcfunction(L, luvL_lib_decoder);
   lua_setfield(L, LUA_REGISTRYINDEX, "luv:lib:decoder");
 
+  lua_pushcfunction(L, luvL_chan_decoder);
+  lua_setfield(L, LUA_REGISTRYINDEX, "luv:chan:decoder");
+
+  lua_pushcfunction(L, luvL_stream_decoder);
+  lua_setfield(L, LUA_REGISTRYINDEX, "luv:stream:decoder");
+
 #ifdef USE_ZMQ
   lua_pushcfunction(L, luvL_zmq_ctx_decoder);
   lua_setfield(L, LUA_REGISTRYINDEX, "luv:zmq:decoder");
@@ -331,15 +336,32 @@ LUALIB_API int luaopen_luv(lua_State *L) {
 
   /* luv.thread */
   luvL_new_module(L, "luv_thread", luv_thread_funcs);
+  luaL_register(L, NULL, luv_pool_funcs);
   lua_setfield(L, -2, "thread");
   luvL_new_class(L, LUV_THREAD_T, luv_thread_meths);
-  lua_pop(L, 1);
+  luvL_new_class(L, LUV_POOL_T, luv_pool_meths);
+  luvL_new_class(L, LUV_TASK_T, luv_task_meths);
+  lua_pop(L, 3);
 
   if (!MAIN_INITIALIZED) {
+    luvL_chan_init();
+    luvL_stream_init();
     luvL_thread_init_main(L);
     lua_pop(L, 1);
   }
 
+  /* luv.scheduler */
+  luvL_new_module(L, "luv_scheduler", luv_scheduler_funcs);
+  lua_setfield(L, -2, "scheduler");
+
+  /* luv.profiler */
+  luvL_new_module(L, "luv_profiler", luv_profiler_funcs);
+  lua_setfield(L, -2, "profiler");
+
+  /* luv.loop */
+  luvL_new_module(L, "luv_loop", luv_loop_funcs);
+  lua_setfield(L, -2, "loop");
+
   /* luv.fiber */
   luvL_new_module(L, "luv_fiber", luv_fiber_funcs);
 
@@ -354,9 +376,29 @@ LUALIB_API int luaopen_luv(lua_State *L) {
   luvL_new_class(L, LUV_FIBER_T, luv_fiber_meths);
   lua_pop(L, 1);
 
+  /* fiber -> coroutine, keeps a dead fiber's coroutine around for join */
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushstring(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUV_FIBER_THREADS);
+
   /* luv.codec */
   luvL_new_module(L, "luv_codec", luv_codec_funcs);
   lua_setfield(L, -2, "codec");
+  luvL_new_class(L, LUV_CODEC_BUF_T, luv_codec_buf_meths);
+  luvL_new_class(L, LUV_CODEC_SCHEMA_T, luv_codec_schema_meths);
+  luvL_new_class(L, LUV_CODEC_SNAP_T, luv_codec_snap_meths);
+  lua_pop(L, 3);
+
+  /* luv.chan */
+  luvL_new_module(L, "luv_chan", luv_chan_funcs);
+  lua_getfield(L, -1, "create");
+  lua_setfield(L, -2, "__call");
+  lua_setfield(L, -2, "chan");
+  luvL_new_class(L, LUV_CHAN_T, luv_chan_meths);
+  lua_pop(L, 1);
 
   /* luv.timer */
   luvL_new_module(L, "luv_timer", luv_timer_funcs);
@@ -407,6 +449,9 @@ LUALIB_API int luaopen_luv(lua_State *L) {
 
   /* luv.net */
   luvL_new_module(L, "luv_net", luv_net_funcs);
+  lua_pushvalue(L, 1);
+  luvL_net_dispatch(L);
+  lua_setfield(L, -2, "dispatch");
   lua_setfield(L, -2, "net");
   luvL_new_class(L, LUV_NET_TCP_T, luv_stream_meths);
   luaL_register(L, NULL, luv_net_tcp_meths);
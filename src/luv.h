@@ -43,6 +43,83 @@ extern "C" {
 #  define TRACE(fmt, ...) ((void)0)
 #endif /* LUV_DEBUG */
 
+/* scheduler statistics, compiled in with -DLUV_STATS */
+#ifdef LUV_STATS
+#  define LUV_STAT(stmt) stmt
+#else
+#  define LUV_STAT(stmt) ((void)0)
+#endif
+
+/* per OS thread storage */
+#ifdef _MSC_VER
+#  define LUV_THREAD_LOCAL __declspec(thread)
+#else
+#  define LUV_THREAD_LOCAL __thread
+#endif
+
+/* timing wheel, one per thread behind a single uv_timer_t */
+#define LUV_WHEEL_BITS   6
+#define LUV_WHEEL_SLOTS  (1 << LUV_WHEEL_BITS)
+#define LUV_WHEEL_MASK   (LUV_WHEEL_SLOTS - 1)
+#define LUV_WHEEL_LEVELS 5
+
+typedef struct luv_wheel_s   luv_wheel_t;
+typedef struct luv_timeout_s luv_timeout_t;
+
+typedef void (*luv_timeout_cb)(luv_timeout_t* timeout);
+
+struct luv_timeout_s {
+  ngx_queue_t     queue;  /* slot link, empty when inactive */
+  uint64_t        due;    /* loop time in ms */
+  uint64_t        repeat;
+  int             level;
+  luv_wheel_t*    wheel;
+  luv_timeout_cb  cb;
+  void*           data;
+};
+
+struct luv_wheel_s {
+  uv_timer_t      timer;
+  uint64_t        base;   /* next tick to run */
+  uint64_t        armed;  /* tick the timer is due at */
+  uint64_t        slack;  /* ms a deadline may be deferred to coalesce */
+  unsigned int    count;
+  unsigned int    nlevel[LUV_WHEEL_LEVELS];
+  ngx_queue_t     slots[LUV_WHEEL_LEVELS][LUV_WHEEL_SLOTS];
+};
+
+/* per thread allocator: sizes up to LUV_ALLOC_SMALL come from free lists
+** of 16 byte size classes carved out of 64k chunks, bigger ones from
+** malloc. The main state keeps the allocator it was created with, which
+** is only wrapped for accounting */
+#define LUV_ALLOC_GRAIN   16
+#define LUV_ALLOC_SMALL   512
+#define LUV_ALLOC_CLASSES (LUV_ALLOC_SMALL / LUV_ALLOC_GRAIN)
+#define LUV_ALLOC_CHUNK   (64 * 1024)
+
+typedef struct luv_alloc_s {
+  void*           free[LUV_ALLOC_CLASSES];
+  char*           next;   /* unused part of the current chunk */
+  char*           end;
+  void*           chunks; /* linked through their first word */
+  size_t          bytes;  /* live bytes as requested */
+  size_t          peak;
+  size_t          reserved; /* chunks and large blocks from malloc */
+  lua_Alloc       base;   /* wrapped allocator, if any */
+  void*           base_ud;
+} luv_alloc_t;
+
+/* limits for decoding untrusted codec data, see luv.codec.decoder */
+#define LUV_CODEC_DEPTH 32
+#define LUV_CODEC_SIZE  (64 << 20)
+
+typedef struct luv_codec_opts_s {
+  int             depth;      /* of nested tables */
+  size_t          size;       /* of a message, 0 for any */
+  int             functions;  /* accept functions, i.e. bytecode */
+  int             hooks;      /* accept __codec values */
+} luv_codec_opts_t;
+
 typedef union luv_handle_u {
   uv_handle_t     handle;
   uv_stream_t     stream;
@@ -60,6 +137,7 @@ typedef union luv_handle_u {
   uv_tty_t        tty;
   uv_udp_t        udp;
   uv_file         file;
+  luv_timeout_t   timeout;
 } luv_handle_t;
 
 typedef union luv_req_u {
@@ -76,6 +154,9 @@ typedef union luv_req_u {
 /* registry table for luv object refs */
 #define LUV_REG_KEY "__LUV__"
 
+/* registry table mapping fibers to their coroutines (weak keys) */
+#define LUV_FIBER_THREADS "luv:fiber:threads"
+
 /* default buffer size for read operations */
 #define LUV_BUF_SIZE 4096
 
@@ -87,6 +168,8 @@ typedef union luv_req_u {
 #define LUV_COND_T        "luv.cond"
 #define LUV_FIBER_T       "luv.fiber"
 #define LUV_THREAD_T      "luv.thread"
+#define LUV_POOL_T        "luv.thread.pool"
+#define LUV_TASK_T        "luv.thread.task"
 #define LUV_ASYNC_T       "luv.async"
 #define LUV_TIMER_T       "luv.timer"
 #define LUV_IDLE_T        "luv.idle"
@@ -100,6 +183,10 @@ typedef union luv_req_u {
 #define LUV_NET_UDP_T     "luv.net.udp"
 #define LUV_ZMQ_CTX_T     "luv.zmq.ctx"
 #define LUV_ZMQ_SOCKET_T  "luv.zmq.socket"
+#define LUV_CHAN_T        "luv.chan"
+#define LUV_CODEC_BUF_T   "luv.codec.buffer"
+#define LUV_CODEC_SCHEMA_T "luv.codec.schema"
+#define LUV_CODEC_SNAP_T  "luv.codec.snapshot"
 
 /* state flags */
 #define LUV_FSTART (1 << 0)
@@ -109,6 +196,10 @@ typedef union luv_req_u {
 #define LUV_FJOIN  (1 << 4)
 #define LUV_FDEAD  (1 << 5)
 
+/* scheduler priorities, 0 is the most urgent */
+#define LUV_NPRIO        8
+#define LUV_PRIO_DEFAULT 4
+
 /* ØMQ flags */
 #define LUV_ZMQ_SCLOSED (1 << 0)
 #define LUV_ZMQ_XDUPCTX (1 << 1)
@@ -136,22 +227,84 @@ typedef enum {
   luv_state_t*  outer; \
   lua_State*    L;     \
   luv_req_t     req;   \
+  luv_timeout_t sleep; \
   void*         data
 
 struct luv_state_s {
   LUV_STATE_FIELDS;
 };
 
+typedef struct luv_fiber_stats_s {
+  uint64_t        resumes;
+  uint64_t        suspends;
+  uint64_t        run_time;   /* ns spent on CPU in lua_resume */
+  uint64_t        wait_time;  /* ns spent in the ready queue */
+  uint64_t        ready_at;
+} luv_fiber_stats_t;
+
+typedef struct luv_thread_stats_s {
+  uint64_t        resumes;
+  uint64_t        loops;      /* uv_run_once iterations */
+  uint64_t        poll_time;  /* ns blocked in uv_run_once */
+  unsigned int    depth;      /* fibers in the ready queue */
+  unsigned int    max_depth;
+} luv_thread_stats_t;
+
+/* log-linear histogram of loop lag in microseconds: values below 16 get
+** a bucket each, then each power of two is split into 16 buckets */
+#define LUV_HIST_SUB     16
+#define LUV_HIST_BUCKETS (LUV_HIST_SUB * 40)
+
+typedef struct luv_hist_s {
+  uint64_t        count;
+  uint64_t        sum;
+  uint64_t        min;
+  uint64_t        max;
+  uint32_t        buckets[LUV_HIST_BUCKETS];
+} luv_hist_t;
+
+typedef struct luv_watchdog_s luv_watchdog_t;
+
 struct luv_thread_s {
   LUV_STATE_FIELDS;
   luv_state_t*    curr;
   uv_thread_t     tid;
   uv_async_t      async;
-  uv_check_t      check;
+  uv_async_t      finish;     /* on the parent's loop, sent on exit */
+  char*           result;     /* encoded results, kept for every joiner */
+  size_t          result_len;
+  uv_check_t      check;      /* with `prepare', brackets each poll */
+  uv_prepare_t    prepare;
+  uint64_t        polled;     /* when the last poll returned */
+  volatile unsigned long turns;
+  luv_hist_t      lag;        /* time the loop was held between polls */
+  luv_watchdog_t* watchdog;
+  ngx_queue_t     chans;      /* channels with waiting states */
+  ngx_queue_t     pool;       /* recycled fibers */
+  int             pool_size;
+  int             pool_max;
+  ngx_queue_t     ready[LUV_NPRIO];
+  unsigned int    ready_mask; /* bit n set when ready[n] is non-empty */
+  unsigned int    aging;      /* serve a less urgent level every n picks */
+  unsigned int    picks;
+  int             aged;       /* the level aging served last */
+  unsigned int    budget;     /* max resumes per tick, 0 is unlimited */
+  uint64_t        slice;      /* max ns per tick, 0 is unlimited */
+  uv_idle_t       idle;       /* forces a non-blocking poll */
+  luv_wheel_t     wheel;      /* sleeps and timers */
+  luv_alloc_t*    alloc;      /* backs L and luv's own buffers */
+  luv_alloc_t     heap;
+#ifdef LUV_STATS
+  luv_thread_stats_t stats;
+#endif
 };
 
 struct luv_fiber_s {
   LUV_STATE_FIELDS;
+  int           prio;
+#ifdef LUV_STATS
+  luv_fiber_stats_t stats;
+#endif
 };
 
 union luv_any_state {
@@ -160,6 +313,10 @@ union luv_any_state {
   luv_thread_t thread;
 };
 
+/* the luv thread driving the event loop of the calling OS thread, its
+** `curr' member is kept up to date by the scheduler */
+extern LUV_THREAD_LOCAL luv_thread_t* luvL_thread_current;
+
 /* luv objects */
 #define LUV_OSTARTED  (1 << 0)
 #define LUV_OSTOPPED  (1 << 1)
@@ -167,6 +324,9 @@ union luv_any_state {
 #define LUV_OCLOSING  (1 << 3)
 #define LUV_OCLOSED   (1 << 4)
 #define LUV_OSHUTDOWN (1 << 5)
+#define LUV_OREUSEPORT (1 << 6) /* tcp: bind with SO_REUSEPORT */
+#define LUV_OFRAMED   (1 << 7) /* stream: reads go to recv's frame buffer */
+#define LUV_OCOMPRESS (1 << 8) /* stream: send compresses messages */
 
 #define luvL_object_is_started(O)  ((O)->flags & LUV_OSTARTED)
 #define luvL_object_is_stopped(O)  ((O)->flags & LUV_OSTOPPED)
@@ -189,12 +349,15 @@ typedef struct luv_object_s {
   LUV_OBJECT_FIELDS;
   luv_handle_t  h;
   uv_buf_t      buf;
+  void*         passed; /* ipc pipes: bytes sent with handles not accepted */
 } luv_object_t;
 
+/* a thread's end of a channel, `data' points to the shared ring and
+** `queue' links it into its thread's list of channels with waiters */
 typedef struct luv_chan_s {
   LUV_OBJECT_FIELDS;
-  void*         put;
-  void*         get;
+  ngx_queue_t   put;  /* states waiting to put */
+  ngx_queue_t   get;  /* states waiting to get */
 } luv_chan_t;
 
 union luv_any_object {
@@ -227,11 +390,14 @@ int  luvL_thread_yield  (luv_thread_t* thread, int narg);
 int  luvL_thread_suspend(luv_thread_t* thread);
 int  luvL_thread_resume (luv_thread_t* thread, int narg);
 void luvL_thread_enqueue(luv_thread_t* thread, luv_fiber_t* fiber);
+void luvL_thread_dequeue(luv_thread_t* thread, luv_fiber_t* fiber);
 
 luv_state_t*  luvL_state_self (lua_State* L);
 luv_thread_t* luvL_thread_self(lua_State* L);
 
 void luvL_thread_init_main(lua_State* L);
+void luvL_thread_init(luv_thread_t* self, lua_State* L, uv_loop_t* loop, luv_state_t* outer);
+void luvL_thread_run (luv_thread_t* self);
 
 luv_fiber_t*  luvL_fiber_create (luv_state_t* outer, int narg);
 luv_thread_t* luvL_thread_create(luv_state_t* outer, int narg);
@@ -244,10 +410,29 @@ int  luvL_thread_once (luv_thread_t* self);
 void luvL_object_init (luv_state_t* state, luv_object_t* self);
 void luvL_object_close(luv_object_t* self);
 
+int  luvL_stream_start(luv_object_t* self);
 int  luvL_stream_stop (luv_object_t* self);
 void luvL_stream_free (luv_object_t* self);
 void luvL_stream_close(luv_object_t* self);
 
+void*      luvL_lua_alloc (void* ud, void* ptr, size_t osize, size_t nsize);
+void       luvL_alloc_init(luv_alloc_t* self, lua_Alloc base, void* base_ud);
+void       luvL_alloc_release(luv_alloc_t* self);
+lua_State* luvL_newstate  (luv_alloc_t* self);
+void*      luvL_alloc     (size_t size);
+void       luvL_free      (void* ptr);
+
+void luvL_lag_init(luv_thread_t* thread);
+void luvL_watchdog_stop(luv_thread_t* thread);
+void luvL_hook_arm     (lua_State* L);
+int  luvL_profiler_active(void);
+void luvL_profiler_sample(lua_State* L);
+
+void luvL_wheel_init    (luv_wheel_t* wheel, uv_loop_t* loop);
+void luvL_timeout_init  (luv_timeout_t* self, luv_wheel_t* wheel, luv_timeout_cb cb);
+void luvL_timeout_start (luv_timeout_t* self, uint64_t timeout, uint64_t repeat);
+void luvL_timeout_stop  (luv_timeout_t* self);
+
 typedef ngx_queue_t luv_cond_t;
 
 int luvL_cond_init      (luv_cond_t* cond);
@@ -256,11 +441,34 @@ int luvL_cond_signal    (luv_cond_t* cond);
 int luvL_cond_broadcast (luv_cond_t* cond);
 
 int luvL_codec_encode(lua_State* L, int narg);
+int luvL_codec_encode_z(lua_State* L, int narg);
 int luvL_codec_decode(lua_State* L);
+int luvL_codec_decode_from(lua_State* L, const char* data, size_t len, size_t* used,
+                           const luv_codec_opts_t* opts);
+void luvL_codec_release(void);
+
+int luvL_codec_dump_file(lua_State* L);
+int luvL_codec_load_file(lua_State* L);
+void luvL_codec_materialize(lua_State* L, int idx);
+
+size_t luvL_lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+int luvL_lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+
+/* a block of n bytes comes out at most this many times larger */
+#define LUV_LZ_RATIO 255
 
 int luvL_lib_decoder(lua_State* L);
+void luvL_chan_init(void);
+int luvL_chan_decoder(lua_State* L);
+void luvL_stream_init(void);
+int luvL_stream_decoder(lua_State* L);
 int luvL_zmq_ctx_decoder(lua_State* L);
 
+void luvL_chan_wakeup(luv_thread_t* thread);
+void luvL_chan_detach(luv_thread_t* thread);
+
+int luvL_net_dispatch(lua_State* L);
+
 uv_buf_t luvL_alloc_cb   (uv_handle_t* handle, size_t size);
 void     luvL_connect_cb (uv_connect_t* conn, int status);
 
@@ -274,6 +482,13 @@ typedef struct luv_const_reg_s {
 
 extern luaL_Reg luv_thread_funcs[32];
 extern luaL_Reg luv_thread_meths[32];
+extern luaL_Reg luv_pool_funcs[32];
+extern luaL_Reg luv_pool_meths[32];
+extern luaL_Reg luv_task_meths[32];
+
+extern luaL_Reg luv_scheduler_funcs[32];
+extern luaL_Reg luv_profiler_funcs[32];
+extern luaL_Reg luv_loop_funcs[32];
 
 extern luaL_Reg luv_fiber_funcs[32];
 extern luaL_Reg luv_fiber_meths[32];
@@ -282,6 +497,12 @@ extern luaL_Reg luv_cond_funcs[32];
 extern luaL_Reg luv_cond_meths[32];
 
 extern luaL_Reg luv_codec_funcs[32];
+extern luaL_Reg luv_codec_buf_meths[32];
+extern luaL_Reg luv_codec_schema_meths[32];
+extern luaL_Reg luv_codec_snap_meths[32];
+
+extern luaL_Reg luv_chan_funcs[32];
+extern luaL_Reg luv_chan_meths[32];
 
 extern luaL_Reg luv_timer_funcs[32];
 extern luaL_Reg luv_timer_meths[32];
@@ -0,0 +1,178 @@
+#include "luv.h"
+#include <stdio.h>
+
+/* Lua tells the allocator the size of the block it frees or resizes, so
+** small blocks need no header: the size class follows from `osize'. Each
+** allocator is only used by the OS thread running its state. */
+
+#define _CLASS(size) (((size) + LUV_ALLOC_GRAIN - 1) / LUV_ALLOC_GRAIN - 1)
+
+static void* _small_alloc(luv_alloc_t* self, size_t size) {
+  int cls = _CLASS(size);
+  void* ptr = self->free[cls];
+  size_t bytes;
+
+  if (ptr) {
+    self->free[cls] = *(void**)ptr;
+    return ptr;
+  }
+
+  bytes = (size_t)(cls + 1) * LUV_ALLOC_GRAIN;
+  if ((size_t)(self->end - self->next) < bytes) {
+    /* the tail of the old chunk is too small to be worth keeping */
+    char* chunk = (char*)malloc(LUV_ALLOC_CHUNK);
+    if (!chunk) return NULL;
+    *(void**)chunk = self->chunks;
+    self->chunks   = chunk;
+    self->next     = chunk + LUV_ALLOC_GRAIN;
+    self->end      = chunk + LUV_ALLOC_CHUNK;
+    self->reserved += LUV_ALLOC_CHUNK;
+  }
+  ptr = self->next;
+  self->next += bytes;
+  return ptr;
+}
+
+static void _small_free(luv_alloc_t* self, void* ptr, size_t size) {
+  int cls = _CLASS(size);
+  *(void**)ptr = self->free[cls];
+  self->free[cls] = ptr;
+}
+
+static void* _pool_realloc(luv_alloc_t* self, void* ptr, size_t osize, size_t nsize) {
+  void* nptr;
+
+  /* Lua frees empty arrays this way */
+  if (!ptr && nsize == 0) return NULL;
+
+  if (nsize == 0) {
+    if (osize <= LUV_ALLOC_SMALL) {
+      _small_free(self, ptr, osize);
+    }
+    else {
+      free(ptr);
+      self->reserved -= osize;
+    }
+    return NULL;
+  }
+
+  if (ptr && osize > LUV_ALLOC_SMALL && nsize > LUV_ALLOC_SMALL) {
+    nptr = realloc(ptr, nsize);
+    if (nptr) self->reserved += nsize - osize;
+    return nptr;
+  }
+  if (ptr && nsize <= LUV_ALLOC_SMALL && _CLASS(osize) == _CLASS(nsize)) {
+    return ptr;
+  }
+
+  if (nsize <= LUV_ALLOC_SMALL) {
+    nptr = _small_alloc(self, nsize);
+  }
+  else {
+    nptr = malloc(nsize);
+    if (nptr) self->reserved += nsize;
+  }
+  if (nptr && ptr) {
+    memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+    _pool_realloc(self, ptr, osize, 0);
+  }
+  return nptr;
+}
+
+void* luvL_lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+  luv_alloc_t* self = (luv_alloc_t*)ud;
+  void* nptr;
+
+  /* for new blocks Lua passes the object type in osize */
+  if (!ptr) osize = 0;
+
+  if (self->base) {
+    nptr = self->base(self->base_ud, ptr, osize, nsize);
+  }
+  else {
+    nptr = _pool_realloc(self, ptr, osize, nsize);
+  }
+
+  if (nptr || nsize == 0) {
+    self->bytes += nsize - osize;
+    if (self->bytes > self->peak) self->peak = self->bytes;
+  }
+  return nptr;
+}
+
+void luvL_alloc_init(luv_alloc_t* self, lua_Alloc base, void* base_ud) {
+  memset(self, 0, sizeof(luv_alloc_t));
+  self->base    = base;
+  self->base_ud = base_ud;
+}
+
+/* give the chunks back, after the state using them has been closed */
+void luvL_alloc_release(luv_alloc_t* self) {
+  while (self->chunks) {
+    void* next = *(void**)self->chunks;
+    free(self->chunks);
+    self->chunks = next;
+  }
+  memset(self->free, 0, sizeof(self->free));
+  self->next = self->end = NULL;
+  self->reserved = 0;
+}
+
+static int _panic(lua_State* L) {
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+    lua_tostring(L, -1));
+  return 0;
+}
+
+/* NULL if no state could be made */
+lua_State* luvL_newstate(luv_alloc_t* self) {
+  lua_State* L;
+  luvL_alloc_init(self, NULL, NULL);
+  L = lua_newstate(luvL_lua_alloc, self);
+  if (!L) {
+    /* LuaJIT on x64 only runs on its own allocator, the heap then
+    ** only serves luv's buffers */
+    L = luaL_newstate();
+  }
+  if (L) lua_atpanic(L, _panic);
+  return L;
+}
+
+/* luv's own buffers: a header remembers the allocator and the size, as
+** they may be freed where neither is at hand */
+typedef union luv_alloc_hdr_u {
+  struct {
+    luv_alloc_t*  alloc;
+    size_t        size;
+  } h;
+  double          align[2];
+} luv_alloc_hdr_t;
+
+void* luvL_alloc(size_t size) {
+  luv_alloc_t* alloc = luvL_thread_current ? luvL_thread_current->alloc : NULL;
+  luv_alloc_hdr_t* hdr;
+
+  size += sizeof(luv_alloc_hdr_t);
+  if (alloc) {
+    hdr = (luv_alloc_hdr_t*)luvL_lua_alloc(alloc, NULL, 0, size);
+  }
+  else {
+    hdr = (luv_alloc_hdr_t*)malloc(size);
+  }
+  if (!hdr) return NULL;
+  hdr->h.alloc = alloc;
+  hdr->h.size  = size;
+  return hdr + 1;
+}
+
+void luvL_free(void* ptr) {
+  luv_alloc_hdr_t* hdr;
+  if (!ptr) return;
+  hdr = (luv_alloc_hdr_t*)ptr - 1;
+  if (hdr->h.alloc) {
+    luvL_lua_alloc(hdr->h.alloc, hdr, hdr->h.size, 0);
+  }
+  else {
+    free(hdr);
+  }
+}
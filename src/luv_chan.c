@@ -0,0 +1,449 @@
+#include "luv.h"
+
+/* A channel is a bounded ring of encoded messages shared between luv
+** threads. The ring is lock-free (Vyukov's bounded queue), each thread
+** holding the channel gets its own luv_chan_t endpoint on which local
+** states wait when the ring is full or empty. Threads with waiters are
+** listed in the ring and poked through their `async' handle whenever
+** another thread makes progress. Encoded channels carry the ring's id,
+** live rings are listed so the decoder can look it up and take its own
+** reference, or fail if the ring is gone. */
+
+#ifdef _WIN32
+#define luv_atomic_cas(P, O, N) \
+  (InterlockedCompareExchangePointer((PVOID volatile*)(P), \
+    (PVOID)(N), (PVOID)(O)) == (PVOID)(O))
+#define luv_atomic_inc(P) InterlockedIncrement((LONG volatile*)(P))
+#define luv_atomic_dec(P) InterlockedDecrement((LONG volatile*)(P))
+#define luv_barrier()     MemoryBarrier()
+#else
+#define luv_atomic_cas(P, O, N) __sync_bool_compare_and_swap(P, O, N)
+#define luv_atomic_inc(P) __sync_add_and_fetch(P, 1)
+#define luv_atomic_dec(P) __sync_sub_and_fetch(P, 1)
+#define luv_barrier()     __sync_synchronize()
+#endif
+
+typedef struct luv_chan_cell_s {
+  volatile size_t seq;
+  char*           data;
+  size_t          size;
+} luv_chan_cell_t;
+
+typedef struct luv_chan_ring_s {
+  struct luv_chan_ring_s* next;
+  unsigned long   id;
+  volatile long   refs;   /* only dropped to 0 under luv_chan_lock */
+  size_t          mask;
+  volatile size_t head;   /* next slot to put */
+  volatile size_t tail;   /* next slot to get */
+  uv_mutex_t      lock;   /* guards the waiting threads below */
+  volatile int    nwait;
+  int             maxwait;
+  luv_thread_t**  wait;
+  luv_chan_cell_t cells[1];
+} luv_chan_ring_t;
+
+static uv_mutex_t       luv_chan_lock;   /* guards the list below */
+static luv_chan_ring_t* luv_chan_rings = NULL;
+static unsigned long    luv_chan_ids   = 0;
+
+void luvL_chan_init(void) {
+  uv_mutex_init(&luv_chan_lock);
+}
+
+static luv_chan_ring_t* _ring_new(size_t cap) {
+  luv_chan_ring_t* ring;
+  size_t i, size = 2;
+  while (size < cap) size <<= 1;
+
+  ring = (luv_chan_ring_t*)malloc(
+    sizeof(luv_chan_ring_t) + (size - 1) * sizeof(luv_chan_cell_t)
+  );
+  ring->refs    = 1;
+  ring->mask    = size - 1;
+  ring->head    = 0;
+  ring->tail    = 0;
+  ring->nwait   = 0;
+  ring->maxwait = 0;
+  ring->wait    = NULL;
+  uv_mutex_init(&ring->lock);
+  for (i = 0; i < size; i++) {
+    ring->cells[i].seq  = i;
+    ring->cells[i].data = NULL;
+    ring->cells[i].size = 0;
+  }
+
+  uv_mutex_lock(&luv_chan_lock);
+  ring->id   = ++luv_chan_ids;
+  ring->next = luv_chan_rings;
+  luv_chan_rings = ring;
+  uv_mutex_unlock(&luv_chan_lock);
+  return ring;
+}
+
+static void _ring_free(luv_chan_ring_t* ring) {
+  size_t i;
+  /* drop undelivered messages */
+  for (i = 0; i <= ring->mask; i++) {
+    if (ring->cells[i].data) free(ring->cells[i].data);
+  }
+  uv_mutex_destroy(&ring->lock);
+  free(ring->wait);
+  free(ring);
+}
+
+/* a new reference to the live ring with `id', or NULL */
+static luv_chan_ring_t* _ring_find(unsigned long id) {
+  luv_chan_ring_t* ring;
+  uv_mutex_lock(&luv_chan_lock);
+  for (ring = luv_chan_rings; ring; ring = ring->next) {
+    if (ring->id == id) {
+      luv_atomic_inc(&ring->refs);
+      break;
+    }
+  }
+  uv_mutex_unlock(&luv_chan_lock);
+  return ring;
+}
+
+static void _ring_release(luv_chan_ring_t* ring) {
+  luv_chan_ring_t** p;
+  uv_mutex_lock(&luv_chan_lock);
+  if (luv_atomic_dec(&ring->refs) > 0) {
+    uv_mutex_unlock(&luv_chan_lock);
+    return;
+  }
+  for (p = &luv_chan_rings; *p != ring; p = &(*p)->next);
+  *p = ring->next;
+  uv_mutex_unlock(&luv_chan_lock);
+  _ring_free(ring);
+}
+
+static int _ring_put(luv_chan_ring_t* ring, char* data, size_t size) {
+  luv_chan_cell_t* cell;
+  size_t pos = ring->head;
+  for (;;) {
+    intptr_t diff;
+    cell = &ring->cells[pos & ring->mask];
+    diff = (intptr_t)cell->seq - (intptr_t)pos;
+    luv_barrier();
+    if (diff == 0) {
+      if (luv_atomic_cas(&ring->head, pos, pos + 1)) break;
+    }
+    else if (diff < 0) {
+      return 0; /* full */
+    }
+    pos = ring->head;
+  }
+  cell->data = data;
+  cell->size = size;
+  luv_barrier();
+  cell->seq = pos + 1;
+  return 1;
+}
+
+static int _ring_get(luv_chan_ring_t* ring, char** data, size_t* size) {
+  luv_chan_cell_t* cell;
+  size_t pos = ring->tail;
+  for (;;) {
+    intptr_t diff;
+    cell = &ring->cells[pos & ring->mask];
+    diff = (intptr_t)cell->seq - (intptr_t)(pos + 1);
+    luv_barrier();
+    if (diff == 0) {
+      if (luv_atomic_cas(&ring->tail, pos, pos + 1)) break;
+    }
+    else if (diff < 0) {
+      return 0; /* empty */
+    }
+    pos = ring->tail;
+  }
+  *data = cell->data;
+  *size = cell->size;
+  cell->data = NULL;
+  luv_barrier();
+  cell->seq = pos + ring->mask + 1;
+  return 1;
+}
+
+/* non-zero if a get or put at the current position could succeed */
+static int _ring_can_get(luv_chan_ring_t* ring) {
+  size_t pos = ring->tail;
+  return ring->cells[pos & ring->mask].seq == pos + 1;
+}
+static int _ring_can_put(luv_chan_ring_t* ring) {
+  size_t pos = ring->head;
+  return ring->cells[pos & ring->mask].seq == pos;
+}
+
+/* poke every thread with waiters after we've made progress */
+static void _ring_notify(luv_chan_ring_t* ring) {
+  int i;
+  luv_barrier();
+  if (!ring->nwait) return;
+  uv_mutex_lock(&ring->lock);
+  for (i = 0; i < ring->nwait; i++) {
+    uv_async_send(&ring->wait[i]->async);
+  }
+  ring->nwait = 0;
+  uv_mutex_unlock(&ring->lock);
+}
+
+static void _ring_watch(luv_chan_ring_t* ring, luv_thread_t* thread) {
+  int i;
+  uv_mutex_lock(&ring->lock);
+  for (i = 0; i < ring->nwait; i++) {
+    if (ring->wait[i] == thread) goto done;
+  }
+  if (ring->nwait == ring->maxwait) {
+    ring->maxwait = ring->maxwait ? ring->maxwait * 2 : 4;
+    ring->wait = (luv_thread_t**)realloc(
+      ring->wait, ring->maxwait * sizeof(luv_thread_t*)
+    );
+  }
+  ring->wait[ring->nwait++] = thread;
+  done:
+  uv_mutex_unlock(&ring->lock);
+  luv_barrier();
+}
+
+static void _ring_unwatch(luv_chan_ring_t* ring, luv_thread_t* thread) {
+  int i;
+  uv_mutex_lock(&ring->lock);
+  for (i = 0; i < ring->nwait; i++) {
+    if (ring->wait[i] == thread) {
+      ring->wait[i] = ring->wait[--ring->nwait];
+      break;
+    }
+  }
+  uv_mutex_unlock(&ring->lock);
+}
+
+static luv_chan_t* _chan_new(lua_State* L, luv_chan_ring_t* ring) {
+  luv_chan_t* self = (luv_chan_t*)lua_newuserdata(L, sizeof(luv_chan_t));
+  luaL_getmetatable(L, LUV_CHAN_T);
+  lua_setmetatable(L, -2);
+
+  ngx_queue_init(&self->rouse);
+  ngx_queue_init(&self->queue);
+  ngx_queue_init(&self->put);
+  ngx_queue_init(&self->get);
+  self->state = (luv_state_t*)luvL_thread_self(L);
+  self->flags = 0;
+  self->count = 0;
+  self->ref   = LUA_NOREF;
+  self->data  = ring;
+  return self;
+}
+
+/* copy the encoded message at the top of L out of the Lua heap */
+static int _chan_push(luv_chan_ring_t* ring, lua_State* L, int idx) {
+  size_t size;
+  const char* str = lua_tolstring(L, idx, &size);
+  char* data = (char*)malloc(size);
+  memcpy(data, str, size);
+  if (_ring_put(ring, data, size)) return 1;
+  free(data);
+  return 0;
+}
+
+static int _chan_decode(lua_State* L) {
+  return luvL_codec_decode(L);
+}
+
+/* leaves the decoded message on the stack of the state, which may be
+** suspended, so the decoding runs on L, the running state */
+static int _chan_pull(luv_chan_ring_t* ring, lua_State* L, luv_state_t* state) {
+  char*  data;
+  size_t size;
+  int    base, n;
+  if (!_ring_get(ring, &data, &size)) return 0;
+  lua_settop(state->L, 0);
+
+  base = lua_gettop(L);
+  lua_pushcfunction(L, _chan_decode);
+  lua_pushlstring(L, data, size);
+  free(data);
+  if (lua_pcall(L, 1, LUA_MULTRET, 0)) {
+    lua_pushboolean(L, 0);
+    lua_insert(L, -2);
+  }
+  n = lua_gettop(L) - base;
+  if (state->L != L) {
+    lua_checkstack(state->L, n);
+    lua_xmove(L, state->L, n);
+  }
+  return 1;
+}
+
+/* the endpoint is anchored in the registry while it has waiters */
+static void _chan_link(luv_chan_t* self, lua_State* L) {
+  luv_thread_t* thread = (luv_thread_t*)self->state;
+  if (ngx_queue_empty(&self->queue)) {
+    ngx_queue_insert_tail(&thread->chans, &self->queue);
+    lua_pushvalue(L, 1);
+    self->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+}
+static void _chan_unlink(luv_chan_t* self) {
+  luv_thread_t* thread = (luv_thread_t*)self->state;
+  _ring_unwatch((luv_chan_ring_t*)self->data, thread);
+  ngx_queue_remove(&self->queue);
+  ngx_queue_init(&self->queue);
+  luaL_unref(thread->L, LUA_REGISTRYINDEX, self->ref);
+  self->ref = LUA_NOREF;
+}
+
+/* wait on the endpoint with the thread registered for notification */
+static int _chan_wait(luv_chan_t* self, luv_cond_t* cond, luv_state_t* curr) {
+  luv_thread_t* thread = (luv_thread_t*)self->state;
+  _chan_link(self, curr->L);
+  _ring_watch((luv_chan_ring_t*)self->data, thread);
+  /* recheck on the next turn of the loop in case we lost a race */
+  uv_async_send(&thread->async);
+  uv_ref((uv_handle_t*)&thread->async);
+  return luvL_cond_wait(cond, curr);
+}
+
+/* serve local waiters as far as the ring allows, returns progress */
+static int _chan_serve(luv_chan_t* self) {
+  luv_chan_ring_t* ring = (luv_chan_ring_t*)self->data;
+  ngx_queue_t* q;
+  luv_state_t* s;
+  int done = 0;
+
+  while (!ngx_queue_empty(&self->get)) {
+    q = ngx_queue_head(&self->get);
+    s = ngx_queue_data(q, luv_state_t, cond);
+    if (!_chan_pull(ring, luvL_thread_current->L, s)) break;
+    ngx_queue_remove(q);
+    luvL_state_ready(s);
+    ++done;
+  }
+  while (!ngx_queue_empty(&self->put)) {
+    q = ngx_queue_head(&self->put);
+    s = ngx_queue_data(q, luv_state_t, cond);
+    /* the waiter left its message as the top of its stack */
+    if (!_chan_push(ring, s->L, -1)) break;
+    ngx_queue_remove(q);
+    lua_settop(s->L, 0);
+    lua_pushboolean(s->L, 1);
+    luvL_state_ready(s);
+    ++done;
+  }
+  return done;
+}
+
+void luvL_chan_wakeup(luv_thread_t* thread) {
+  ngx_queue_t* q = ngx_queue_head(&thread->chans);
+  while (q != ngx_queue_sentinel(&thread->chans)) {
+    luv_chan_t* self = ngx_queue_data(q, luv_chan_t, queue);
+    luv_chan_ring_t* ring = (luv_chan_ring_t*)self->data;
+    q = ngx_queue_next(q);
+
+    for (;;) {
+      if (_chan_serve(self)) _ring_notify(ring);
+      if (ngx_queue_empty(&self->get) && ngx_queue_empty(&self->put)) {
+        _chan_unlink(self);
+        break;
+      }
+      _ring_watch(ring, thread);
+      /* a peer may have moved between serving and watching */
+      if (!(!ngx_queue_empty(&self->get) && _ring_can_get(ring))
+       && !(!ngx_queue_empty(&self->put) && _ring_can_put(ring))) {
+        break;
+      }
+    }
+  }
+}
+
+/* called when a thread exits, its waiters will never be served */
+void luvL_chan_detach(luv_thread_t* thread) {
+  while (!ngx_queue_empty(&thread->chans)) {
+    ngx_queue_t* q = ngx_queue_head(&thread->chans);
+    _chan_unlink(ngx_queue_data(q, luv_chan_t, queue));
+  }
+}
+
+/* Lua API */
+static int luv_new_chan(lua_State* L) {
+  lua_Integer cap = luaL_optinteger(L, 1, 64);
+  luaL_argcheck(L, cap > 0, 1, "capacity must be positive");
+  _chan_new(L, _ring_new((size_t)cap));
+  return 1;
+}
+
+static int luv_chan_put(lua_State* L) {
+  luv_chan_t* self = (luv_chan_t*)luaL_checkudata(L, 1, LUV_CHAN_T);
+  luv_chan_ring_t* ring = (luv_chan_ring_t*)self->data;
+  luv_state_t* curr;
+
+  luvL_codec_encode(L, lua_gettop(L) - 1);
+  if (_chan_push(ring, L, -1)) {
+    _ring_notify(ring);
+    lua_settop(L, 0);
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+
+  TRACE("channel full, waiting\n");
+  curr = luvL_state_self(L);
+  return _chan_wait(self, &self->put, curr);
+}
+
+static int luv_chan_get(lua_State* L) {
+  luv_chan_t* self = (luv_chan_t*)luaL_checkudata(L, 1, LUV_CHAN_T);
+  luv_chan_ring_t* ring = (luv_chan_ring_t*)self->data;
+  luv_state_t* curr = luvL_state_self(L);
+
+  if (_chan_pull(ring, L, curr)) {
+    _ring_notify(ring);
+    return lua_gettop(L);
+  }
+
+  TRACE("channel empty, waiting\n");
+  return _chan_wait(self, &self->get, curr);
+}
+
+static int luv_chan_encoder(lua_State* L) {
+  luv_chan_t* self = (luv_chan_t*)luaL_checkudata(L, 1, LUV_CHAN_T);
+  luv_chan_ring_t* ring = (luv_chan_ring_t*)self->data;
+  lua_pushstring(L, "luv:chan:decoder");
+  lua_pushnumber(L, (lua_Number)ring->id);
+  return 2;
+}
+
+int luvL_chan_decoder(lua_State* L) {
+  luv_chan_ring_t* ring = _ring_find((unsigned long)luaL_checknumber(L, -1));
+  if (!ring) {
+    return luaL_error(L, "channel no longer exists");
+  }
+  _chan_new(L, ring);
+  return 1;
+}
+
+static int luv_chan_free(lua_State* L) {
+  luv_chan_t* self = (luv_chan_t*)lua_touserdata(L, 1);
+  _ring_release((luv_chan_ring_t*)self->data);
+  return 0;
+}
+
+static int luv_chan_tostring(lua_State* L) {
+  luv_chan_t* self = (luv_chan_t*)luaL_checkudata(L, 1, LUV_CHAN_T);
+  lua_pushfstring(L, "userdata<%s>: %p", LUV_CHAN_T, self);
+  return 1;
+}
+
+luaL_Reg luv_chan_funcs[] = {
+  {"create",    luv_new_chan},
+  {NULL,        NULL}
+};
+
+luaL_Reg luv_chan_meths[] = {
+  {"put",       luv_chan_put},
+  {"get",       luv_chan_get},
+  {"__codec",   luv_chan_encoder},
+  {"__gc",      luv_chan_free},
+  {"__tostring",luv_chan_tostring},
+  {NULL,        NULL}
+};
@@ -7,15 +7,61 @@
 #define LUV_CODEC_TVAL 2
 #define LUV_CODEC_TUSR 3
 
+/* format versions: v1 has no header, v2 data starts with 0, 2 which v1
+** can't, as an empty v1 tuple is the single byte 0. Other bytes up to
+** LUV_CODEC_VMAX after a 0 are versions too, unknown ones are refused */
+#define LUV_CODEC_V1 1
+#define LUV_CODEC_V2 2
+#define LUV_CODEC_V2S 3 /* v2 values of a record laid out by a schema */
+#define LUV_CODEC_V2Z 4 /* a compressed message, see luv_lz.c */
+#define LUV_CODEC_VMAX 15
+
+/* messages shorter than this aren't worth compressing */
+#define LUV_CODEC_ZMIN 64
+
+/* v2 value tags besides the Lua types */
+#define LUV_CODEC_TINT  0x10 /* integral number as a zigzag varint */
+#define LUV_CODEC_TSREF 0x11 /* ref, a string seen before */
+#define LUV_CODEC_TREC  0x12 /* the fields of a record of a nested schema */
+#define LUV_CODEC_TSTR  0x40 /* | len, strings shorter than 32 bytes */
+#define LUV_CODEC_TSINT 0x80 /* | val, integers from 0 to 127 */
+
+/* v2 strings this long or longer take a ref like tables, so repeats
+** such as the keys of an array of records are written once */
+#define LUV_CODEC_SMIN  4
+
 /* TODO: make this buffer stuff generic */
 typedef struct luv_buf_t {
   size_t   size;
   uint8_t* head;
   uint8_t* base;
+  int      version; /* format being encoded or decoded */
+  const luv_codec_opts_t* opts; /* limits when decoding untrusted data */
+  int      depth;
 } luv_buf_t;
 
 static int encode_table(lua_State* L, luv_buf_t *buf, int seen);
-static int decode_table(lua_State* L, luv_buf_t* buf, int seen);
+static int decode_table(lua_State* L, luv_buf_t* buf, int seen, int ref);
+
+/* per thread encode buffer, keeps its capacity between calls unless it
+** grew past LUV_CODEC_KEEP */
+#define LUV_CODEC_KEEP (1024 * 1024)
+
+static LUV_THREAD_LOCAL luv_buf_t luv_codec_buf;
+static LUV_THREAD_LOCAL luv_buf_t luv_codec_zbuf;
+static LUV_THREAD_LOCAL int       luv_codec_busy;
+static LUV_THREAD_LOCAL int       luv_codec_fmt = LUV_CODEC_V2;
+
+/* Function caches, in each state's registry. Encoding keeps the dump of
+** each function value, weakly keyed by the function. Decoding keeps the
+** functions loaded from bytecode, keyed by a hash of it, but a loaded
+** function can only be handed out again if it has no upvalues, as there
+** is no way to make another closure of it without loading it again */
+#define LUV_CODEC_DUMPS  "luv:codec:dumps"
+#define LUV_CODEC_LOADED "luv:codec:loaded"
+#define LUV_CODEC_CACHE  64 /* loaded functions kept */
+
+static LUV_THREAD_LOCAL int       luv_codec_nocache;
 
 luv_buf_t* luvL_buf_new(size_t size) {
   luv_buf_t* buf;		
@@ -79,6 +125,29 @@ void luvL_buf_write_uleb128(luv_buf_t* buf, uint32_t val) {
   buf->head += n;
 }
 
+void luvL_buf_write_uleb64(luv_buf_t* buf, uint64_t val) {
+  size_t   n = 0;
+  uint8_t* p;
+  luvL_buf_need(buf, 10);
+  p = buf->head;
+  for (; val >= 0x80; val >>= 7) {
+    p[n++] = (uint8_t)((val & 0x7f) | 0x80);
+  }
+  p[n++] = (uint8_t)val;
+  buf->head += n;
+}
+
+/* fill in 5 bytes reserved for a length, a uleb128 padded with
+** continuation bits reads back the same as the short form */
+void luvL_buf_patch_uleb128(uint8_t* p, uint32_t val) {
+  int i;
+  for (i = 0; i < 4; i++) {
+    p[i] = (uint8_t)((val & 0x7f) | 0x80);
+    val >>= 7;
+  }
+  p[4] = (uint8_t)val;
+}
+
 /* for lua_dump */
 int luvL_writer(lua_State* L, const char* str, size_t len, void* buf) {
   (void)L;
@@ -107,10 +176,48 @@ uint32_t luvL_buf_read_uleb128(luv_buf_t* buf) {
   buf->head = (uint8_t*)p;
   return v;
 }
+uint64_t luvL_buf_read_uleb64(luv_buf_t* buf) {
+  const uint8_t* p = (const uint8_t*)buf->head;
+  uint64_t v = 0;
+  int sh = 0;
+  do {
+    v |= (uint64_t)(*p & 0x7f) << sh;
+    sh += 7;
+  } while (*p++ >= 0x80);
+  buf->head = (uint8_t*)p;
+  return v;
+}
 uint8_t luvL_buf_peek(luv_buf_t* buf) {
   return *buf->head;
 }
 
+/* push the registry table `name', creating it with weak `mode' */
+static void codec_cache(lua_State* L, const char* name, const char* mode) {
+  lua_getfield(L, LUA_REGISTRYINDEX, name);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    if (mode) {
+      lua_createtable(L, 0, 1);
+      lua_pushstring(L, mode);
+      lua_setfield(L, -2, "__mode");
+      lua_setmetatable(L, -2);
+    }
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, name);
+  }
+}
+
+/* FNV-1a */
+static uint32_t codec_hash(const char* data, size_t len) {
+  uint32_t h = 2166136261U;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)data[i]) * 16777619U;
+  }
+  return h;
+}
+
 #define encoder_seen(L, idx, seen) do {\
   int ref = lua_objlen(L, seen) + 1; \
   lua_pushboolean(L, 1); \
@@ -132,12 +239,59 @@ uint8_t luvL_buf_peek(luv_buf_t* buf) {
   lua_pop(L, 2); \
 } while (0)
 
+/* v2 forms of integral numbers and strings, returns 0 for values left
+** to encode_value */
+static int encode_compact(lua_State* L, luv_buf_t* buf, int val_type, int seen) {
+  if (val_type == LUA_TNUMBER) {
+    lua_Number v = lua_tonumber(L, -1);
+    int64_t i;
+    /* also false for NaN */
+    if (!(v >= -9223372036854775808.0 && v < 9223372036854775808.0)) return 0;
+    i = (int64_t)v;
+    if ((lua_Number)i != v || (v == 0 && 1 / v < 0)) return 0;
+    if (i >= 0 && i < 128) {
+      luvL_buf_put(buf, (uint8_t)(LUV_CODEC_TSINT | i));
+    }
+    else {
+      luvL_buf_put(buf, LUV_CODEC_TINT);
+      luvL_buf_write_uleb64(buf, ((uint64_t)i << 1) ^ (uint64_t)(i >> 63));
+    }
+    return 1;
+  }
+  if (val_type == LUA_TSTRING) {
+    size_t len;
+    const char* str = lua_tolstring(L, -1, &len);
+    if (len >= LUV_CODEC_SMIN) {
+      lua_pushvalue(L, -1);
+      lua_rawget(L, seen);
+      if (!lua_isnil(L, -1)) {
+        luvL_buf_put(buf, LUV_CODEC_TSREF);
+        luvL_buf_write_uleb128(buf, (uint32_t)lua_tointeger(L, -1));
+        lua_pop(L, 1);
+        return 1;
+      }
+      lua_pop(L, 1);
+      encoder_seen(L, -1, seen);
+    }
+    if (len >= 32) return 0;
+    luvL_buf_put(buf, (uint8_t)(LUV_CODEC_TSTR | len));
+    luvL_buf_write(buf, (uint8_t*)str, len);
+    return 1;
+  }
+  return 0;
+}
+
 static void encode_value(lua_State* L, luv_buf_t* buf, int val, int seen) {
   size_t len;
   int val_type = lua_type(L, val);
 
   lua_pushvalue(L, val);
 
+  if (buf->version >= LUV_CODEC_V2 && encode_compact(L, buf, val_type, seen)) {
+    lua_pop(L, 1);
+    return;
+  }
+
   luvL_buf_put(buf, (uint8_t)val_type);
 
   switch (val_type) {
@@ -196,16 +350,44 @@ static void encode_value(lua_State* L, luv_buf_t* buf, int val, int seen) {
     }
     else {
       int i;
+      size_t mark;
+      const char* code = NULL;
 	  lua_Debug ar;
-      luv_buf_t b; 
-	  b.base = NULL; b.head = NULL; b.size = 0;
 
       lua_pop(L, 1); /* pop nil */
 
-      lua_pushvalue(L, -1);
-      lua_getinfo(L, ">nuS", &ar);
-      if (ar.what[0] != 'L') {
-        luaL_error(L, "attempt to persist a C function '%s'", ar.name);
+      if (!luv_codec_nocache) {
+        codec_cache(L, LUV_CODEC_DUMPS, "k");
+        lua_pushvalue(L, -2);
+        lua_rawget(L, -2);
+        lua_remove(L, -2);
+        if (lua_isnil(L, -1)) lua_pop(L, 1);
+        else code = lua_tolstring(L, -1, &len);
+      }
+
+      if (!code) {
+        lua_pushvalue(L, -1);
+        lua_getinfo(L, ">nuS", &ar);
+        if (ar.what[0] != 'L') {
+          luaL_error(L, "attempt to persist a C function '%s'", ar.name);
+        }
+      }
+      if (!code && !luv_codec_nocache) {
+        luv_buf_t dump;
+        dump.base = NULL; dump.head = NULL; dump.size = 0;
+        lua_dump(L, (lua_Writer)luvL_writer, &dump);
+        lua_pushlstring(L, (char *)dump.base, dump.head - dump.base);
+        luvL_buf_close(&dump);
+        codec_cache(L, LUV_CODEC_DUMPS, "k");
+        lua_pushvalue(L, -3);
+        lua_pushvalue(L, -3);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+        code = lua_tolstring(L, -1, &len);
+      }
+      if (code) {
+        /* the dump stays below the function while it is written */
+        lua_insert(L, -2);
       }
 
       encoder_seen(L, -1, seen);
@@ -213,21 +395,27 @@ static void encode_value(lua_State* L, luv_buf_t* buf, int val, int seen) {
       tag = LUV_CODEC_TVAL;
       luvL_buf_put(buf, tag);
 
-      lua_dump(L, (lua_Writer)luvL_writer, &b);
-
-      len = (size_t)(b.head - b.base);
-      luvL_buf_write_uleb128(buf, (uint32_t)len);
-      luvL_buf_write(buf, b.base, len);
-      luvL_buf_close(&b);
+      if (code) {
+        luvL_buf_write_uleb128(buf, (uint32_t)len);
+        luvL_buf_write(buf, (uint8_t*)code, len);
+      }
+      else {
+        /* dump straight into buf behind room for the length */
+        luvL_buf_need(buf, 5);
+        mark = buf->head - buf->base;
+        buf->head += 5;
+        lua_dump(L, (lua_Writer)luvL_writer, buf);
+        len = (size_t)(buf->head - buf->base) - mark - 5;
+        luvL_buf_patch_uleb128(buf->base + mark, (uint32_t)len);
+      }
 
       lua_newtable(L);
-      for (i = 1; i <= ar.nups; i++) {
-        lua_getupvalue(L, -2, i);
+      for (i = 1; lua_getupvalue(L, -2, i); i++) {
         lua_rawseti(L, -2, i);
       }
-      assert(lua_objlen(L, -1) == ar.nups);
       encode_table(L, buf, seen);
       lua_pop(L, 1);
+      if (code) lua_remove(L, -2);
     }
 
     break;
@@ -255,7 +443,51 @@ static void encode_value(lua_State* L, luv_buf_t* buf, int val, int seen) {
   lua_pop(L, 1);
 }
 
+/* is the key at idx one of the array part's 1..narr */
+static int in_array(lua_State* L, int idx, uint32_t narr) {
+  lua_Number k;
+  if (lua_type(L, idx) != LUA_TNUMBER) return 0;
+  k = lua_tonumber(L, idx);
+  return k >= 1 && k <= narr && k == (lua_Number)(uint32_t)k;
+}
+
+/* v2: the lengths of the array part and of the rest up front, so the
+** decoder can size the table, then the array by index without keys */
+static int encode_table2(lua_State* L, luv_buf_t* buf, int seen) {
+  uint32_t i, narr, nrec = 0;
+  narr = (uint32_t)lua_rawlen(L, -1);
+
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0) {
+    lua_pop(L, 1);
+    if (!in_array(L, -1, narr)) nrec++;
+  }
+  luvL_buf_write_uleb128(buf, narr);
+  luvL_buf_write_uleb128(buf, nrec);
+
+  for (i = 1; i <= narr; i++) {
+    lua_rawgeti(L, -1, i);
+    encode_value(L, buf, -1, seen);
+    lua_pop(L, 1);
+  }
+
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0) {
+    if (!in_array(L, -2, narr)) {
+      encode_value(L, buf, -2, seen);
+      encode_value(L, buf, -1, seen);
+    }
+    lua_pop(L, 1);
+  }
+  return 1;
+}
+
 static int encode_table(lua_State* L, luv_buf_t* buf, int seen) {
+  luvL_codec_materialize(L, -1);
+  if (buf->version >= LUV_CODEC_V2) {
+    return encode_table2(L, buf, seen);
+  }
+
   lua_pushnil(L);
   while (lua_next(L, -2) != 0) {
     int top = lua_gettop(L);
@@ -273,13 +505,80 @@ static int encode_table(lua_State* L, luv_buf_t* buf, int seen) {
   return 1;
 }
 
+/* reads while decoding. Data decoded with opts is untrusted, so each
+** read checks once that it doesn't run past the end */
+#define decode_left(buf) ((size_t)((buf)->base + (buf)->size - (buf)->head))
+
+static void decode_short(lua_State* L, luv_buf_t* buf) {
+  if (buf->opts && buf->opts->size && buf->size == buf->opts->size) {
+    luaL_error(L, "codec: message too large");
+  }
+  luaL_error(L, "codec: truncated data");
+}
+static uint8_t decode_get(lua_State* L, luv_buf_t* buf) {
+  if (buf->opts && !decode_left(buf)) decode_short(L, buf);
+  return *(buf->head++);
+}
+static uint8_t* decode_read(lua_State* L, luv_buf_t* buf, size_t len) {
+  if (buf->opts && decode_left(buf) < len) decode_short(L, buf);
+  return luvL_buf_read(buf, len);
+}
+/* a varint of at most `max' bytes */
+static uint64_t decode_uleb(lua_State* L, luv_buf_t* buf, int max) {
+  const uint8_t* p = buf->head;
+  const uint8_t* e;
+  uint64_t v = 0;
+  int sh = 0;
+  if (!buf->opts) return luvL_buf_read_uleb64(buf);
+  e = buf->base + buf->size;
+  if (e - p > max) e = p + max;
+  do {
+    if (p == e) {
+      if (decode_left(buf) > (size_t)max) luaL_error(L, "codec: bad varint");
+      decode_short(L, buf);
+    }
+    v |= (uint64_t)(*p & 0x7f) << sh;
+    sh += 7;
+  } while (*p++ >= 0x80);
+  buf->head = (uint8_t*)p;
+  return v;
+}
+static uint32_t decode_uleb32(lua_State* L, luv_buf_t* buf) {
+  uint64_t v;
+  if (!buf->opts) return luvL_buf_read_uleb128(buf);
+  v = decode_uleb(L, buf, 5);
+  if (v > 0xffffffffU) luaL_error(L, "codec: bad varint");
+  return (uint32_t)v;
+}
+/* a ref must be to something decoded before */
+static uint32_t decode_ref(lua_State* L, luv_buf_t* buf, int seen) {
+  uint32_t ref = decode_uleb32(L, buf);
+  if (buf->opts && (ref < 1 || ref > lua_objlen(L, seen))) {
+    luaL_error(L, "codec: bad reference");
+  }
+  return ref;
+}
+static void decode_accept(lua_State* L, luv_buf_t* buf, int ok, const char* what) {
+  if (buf->opts && !ok) luaL_error(L, "codec: %s not accepted", what);
+}
+
+/* one more level of tables or hooks, left with buf->depth-- */
+static void decode_enter(lua_State* L, luv_buf_t* buf) {
+  luaL_checkstack(L, 4, "codec: tables nested too deeply");
+  if (buf->opts && ++buf->depth > buf->opts->depth) {
+    luaL_error(L, "codec: tables nested too deeply");
+  }
+}
+
 static void find_decoder(lua_State* L, luv_buf_t* buf, int seen) {
   int i;
   int lookup[2] = {
     LUA_REGISTRYINDEX,
     LUA_GLOBALSINDEX
   };
-  for (i = 0; i < 2; i++) {
+  /* untrusted data only gets decoders registered by name */
+  int nlookup = buf->opts ? 1 : 2;
+  for (i = 0; i < nlookup; i++) {
     lua_pushvalue(L, -1);
     lua_gettable(L, lookup[i]);
     if (lua_isnil(L, -1)) {
@@ -296,6 +595,69 @@ static void find_decoder(lua_State* L, luv_buf_t* buf, int seen) {
   }
 }
 
+/* is the upvalue table coming up empty */
+static int decode_noups(luv_buf_t* buf) {
+  if (buf->version >= LUV_CODEC_V2) {
+    return decode_left(buf) >= 2 && buf->head[0] == 0 && buf->head[1] == 0;
+  }
+  return decode_left(buf) >= 1 && buf->head[0] == LUA_TNIL;
+}
+
+/* push the function loaded from `code', which was sent without upvalues,
+** so the one loaded before from the same code will do. Only functions
+** which really have none are kept */
+static void decode_load_cached(lua_State* L, const char* code, size_t len) {
+  lua_Integer h = (lua_Integer)codec_hash(code, len);
+  size_t size;
+  const char* prev;
+
+  codec_cache(L, LUV_CODEC_LOADED, NULL);
+  lua_rawgeti(L, -1, h);
+  if (!lua_isnil(L, -1)) {
+    lua_rawgeti(L, -1, 1);
+    prev = lua_tolstring(L, -1, &size);
+    if (size == len && !memcmp(prev, code, len)) {
+      lua_rawgeti(L, -2, 2);
+      lua_replace(L, -4);
+      lua_pop(L, 2);
+      return;
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+
+  if (luaL_loadbuffer(L, code, len, "=chunk")) {
+    luaL_error(L, "failed to load chunk\n");
+  }
+  if (lua_getupvalue(L, -1, 1)) {
+    /* upvalues which were nil when encoded, not shareable after all */
+    lua_pop(L, 1);
+    lua_remove(L, -2);
+    return;
+  }
+  lua_getfield(L, -2, "n");
+  if (lua_tointeger(L, -1) >= LUV_CODEC_CACHE) {
+    /* start over rather than track which are in use */
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUV_CODEC_LOADED);
+    lua_replace(L, -3);
+    lua_pushinteger(L, 0);
+  }
+  lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+  lua_setfield(L, -4, "n");
+  lua_pop(L, 1);
+
+  lua_createtable(L, 2, 0);
+  lua_pushlstring(L, code, len);
+  lua_rawseti(L, -2, 1);
+  lua_pushvalue(L, -2);
+  lua_rawseti(L, -2, 2);
+  lua_rawseti(L, -3, h);
+  lua_remove(L, -2);
+}
+
 #define decoder_seen(L, idx, seen) do { \
   int ref = lua_objlen(L, seen) + 1; \
   lua_pushvalue(L, idx); \
@@ -303,82 +665,120 @@ static void find_decoder(lua_State* L, luv_buf_t* buf, int seen) {
 } while (0)
 
 static void decode_value(lua_State* L, luv_buf_t* buf, int seen) {
-  uint8_t val_type = luvL_buf_get(buf);
+  uint8_t val_type = decode_get(L, buf);
   size_t  len;
+
+  if (val_type & LUV_CODEC_TSINT) {
+    lua_pushinteger(L, val_type & 0x7f);
+    return;
+  }
+  if ((val_type & 0xe0) == LUV_CODEC_TSTR) {
+    len = val_type & 0x1f;
+    lua_pushlstring(L, (const char *)decode_read(L, buf, len), len);
+    if (len >= LUV_CODEC_SMIN) decoder_seen(L, -1, seen);
+    return;
+  }
+
   switch (val_type) {
+  case LUV_CODEC_TSREF: {
+    uint32_t ref = decode_ref(L, buf, seen);
+    lua_rawgeti(L, seen, ref);
+    break;
+  }
+  case LUV_CODEC_TINT: {
+    uint64_t v = decode_uleb(L, buf, 10);
+    lua_pushnumber(L, (lua_Number)((int64_t)(v >> 1) ^ -(int64_t)(v & 1)));
+    break;
+  }
   case LUA_TBOOLEAN: {
-    int val = luvL_buf_get(buf);
+    int val = decode_get(L, buf);
     lua_pushboolean(L, val);
     break;
   }
   case LUA_TNUMBER: {
-    uint8_t* ptr = luvL_buf_read(buf, sizeof(lua_Number));
-    lua_pushnumber(L, *(lua_Number*)(void*)ptr);
+    lua_Number val;
+    memcpy(&val, decode_read(L, buf, sizeof(lua_Number)), sizeof(lua_Number));
+    lua_pushnumber(L, val);
     break;
   }
   case LUA_TSTRING: {
 	uint8_t* ptr;
-    len = (size_t)luvL_buf_read_uleb128(buf);
-    ptr = luvL_buf_read(buf, len);
+    len = (size_t)decode_uleb32(L, buf);
+    ptr = decode_read(L, buf, len);
     lua_pushlstring(L, (const char *)ptr, len);
+    if (buf->version >= LUV_CODEC_V2 && len >= LUV_CODEC_SMIN) {
+      decoder_seen(L, -1, seen);
+    }
     break;
   }
   case LUA_TTABLE: {
-    uint8_t  tag = luvL_buf_get(buf);
+    uint8_t  tag = decode_get(L, buf);
     uint32_t ref;
     if (tag == LUV_CODEC_TREF) {
-      ref = luvL_buf_read_uleb128(buf);
+      ref = decode_ref(L, buf, seen);
       lua_rawgeti(L, seen, ref);
     }
     else {
       if (tag == LUV_CODEC_TUSR) {
+        decode_accept(L, buf, buf->opts && buf->opts->hooks, "__codec hooks");
+        decode_enter(L, buf);
+        /* the encoder saw the table before the hook, so take its ref now
+        ** and fill it in once the hook has made the value */
+        ref = lua_objlen(L, seen) + 1;
+        lua_pushboolean(L, 0);
+        lua_rawseti(L, seen, ref);
         decode_value(L, buf, seen); /* hook */
         if (lua_type(L, -1) == LUA_TSTRING) {
           find_decoder(L, buf, seen);
         }
         decode_value(L, buf, seen); /* any value */
         lua_call(L, 1, 1);          /* result */
-        decoder_seen(L, -1, seen);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, seen, ref);
+        buf->depth--;
       }
       else {
-        lua_newtable(L);
-        decoder_seen(L, -1, seen);
-        decode_table(L, buf, seen);
+        decode_table(L, buf, seen, 1);
       }
     }
     break;
   }
   case LUA_TFUNCTION: {
     size_t nups;
-    uint8_t tag = luvL_buf_get(buf);
+    uint8_t tag = decode_get(L, buf);
     if (tag == LUV_CODEC_TREF) {
-      uint32_t ref = luvL_buf_read_uleb128(buf);
+      uint32_t ref = decode_ref(L, buf, seen);
       lua_rawgeti(L, seen, ref);
     }
     else {
       size_t i;
 	  const char* code;
-      len = luvL_buf_read_uleb128(buf);
-      code = (char *)luvL_buf_read(buf, len);
-      if (luaL_loadbuffer(L, code, len, "=chunk")) {
+      decode_accept(L, buf, buf->opts && buf->opts->functions, "functions");
+      len = decode_uleb32(L, buf);
+      code = (char *)decode_read(L, buf, len);
+      if (!luv_codec_nocache && decode_noups(buf)) {
+        decode_load_cached(L, code, len);
+      }
+      else if (luaL_loadbuffer(L, code, len, "=chunk")) {
         luaL_error(L, "failed to load chunk\n");
       }
 
       decoder_seen(L, -1, seen);
-      lua_newtable(L);
-      decode_table(L, buf, seen);
+      decode_table(L, buf, seen, 0);
       nups = lua_objlen(L, -1);
       for (i=1; i <= nups; i++) {
         lua_rawgeti(L, -1, i);
-        lua_setupvalue(L, -3, i);
+        if (!lua_setupvalue(L, -3, i)) lua_pop(L, 1);
       }
       lua_pop(L, 1);
     }
     break;
   }
   case LUA_TUSERDATA: {
-    uint8_t tag = luvL_buf_get(buf);
-    assert(tag == LUV_CODEC_TUSR);
+    uint8_t tag = decode_get(L, buf);
+    if (tag != LUV_CODEC_TUSR) luaL_error(L, "bad code");
+    decode_accept(L, buf, buf->opts && buf->opts->hooks, "__codec hooks");
+    decode_enter(L, buf);
     decode_value(L, buf, seen); /* hook */
     if (lua_type(L, -1) == LUA_TSTRING) {
       find_decoder(L, buf, seen);
@@ -386,11 +786,14 @@ static void decode_value(lua_State* L, luv_buf_t* buf, int seen) {
     decode_value(L, buf, seen); /* any value */
     luaL_checktype(L, -2, LUA_TFUNCTION);
     lua_call(L, 1, 1);          /* result */
+    buf->depth--;
     break;
   }
   case LUA_TLIGHTUSERDATA: {
-    uint8_t* ptr = luvL_buf_read(buf, sizeof(void*));
-    lua_pushlightuserdata(L, *(void**)ptr);
+    void* ptr;
+    decode_accept(L, buf, 0, "light userdata");
+    memcpy(&ptr, decode_read(L, buf, sizeof(void*)), sizeof(void*));
+    lua_pushlightuserdata(L, ptr);
     break;
   }
   case LUA_TNIL:
@@ -402,10 +805,42 @@ static void decode_value(lua_State* L, luv_buf_t* buf, int seen) {
   }
 }
 
-static int decode_table(lua_State* L, luv_buf_t* buf, int seen) {
-  for (;luvL_buf_peek(buf) != LUA_TNIL;) {
+/* push a table decoded from buf, with `ref' set later values may refer
+** to it */
+static int decode_table(lua_State* L, luv_buf_t* buf, int seen, int ref) {
+  decode_enter(L, buf);
+  if (buf->version >= LUV_CODEC_V2) {
+    uint32_t i;
+    uint32_t narr = decode_uleb32(L, buf);
+    uint32_t nrec = decode_uleb32(L, buf);
+    /* every value takes a byte at least */
+    if (buf->opts && (narr > decode_left(buf) || nrec > decode_left(buf) / 2)) {
+      decode_short(L, buf);
+    }
+    lua_createtable(L, (int)narr, (int)nrec);
+    if (ref) decoder_seen(L, -1, seen);
+    for (i = 1; i <= narr; i++) {
+      decode_value(L, buf, seen);
+      lua_rawseti(L, -2, i);
+    }
+    for (i = 0; i < nrec; i++) {
+      decode_value(L, buf, seen);
+      decode_value(L, buf, seen);
+      if (lua_isnil(L, -2)) luaL_error(L, "codec: nil table key");
+      lua_rawset(L, -3);
+    }
+    buf->depth--;
+    return 1;
+  }
+
+  lua_newtable(L);
+  if (ref) decoder_seen(L, -1, seen);
+  for (;;) {
+    if (buf->opts && !decode_left(buf)) decode_short(L, buf);
+    if (luvL_buf_peek(buf) == LUA_TNIL) break;
     decode_value(L, buf, seen);
     decode_value(L, buf, seen);
+    if (lua_isnil(L, -2)) luaL_error(L, "codec: nil table key");
     lua_settable(L, -3);
   }
 
@@ -413,12 +848,73 @@ static int decode_table(lua_State* L, luv_buf_t* buf, int seen) {
   decode_value(L, buf, seen);
   assert(lua_type(L, -1) == LUA_TNIL);
   lua_pop(L, 1);
+  buf->depth--;
   return 1;
 }
 
-int luvL_codec_encode(lua_State* L, int narg) {
+/* Schemas: a record's fields are written in the order of the schema's
+** field list, without keys. Field values go through encode_value, and
+** a field with a schema of its own has its table written as a record
+** too. The keys and nested schemas are kept in a table in the registry,
+** key i at 2i - 1 and its schema or false at 2i */
+typedef struct luv_codec_schema_s {
+  int nfields;
+  int ref;
+} luv_codec_schema_t;
+
+/* the record at -1 */
+static void encode_record(lua_State* L, luv_buf_t* buf, luv_codec_schema_t* self, int seen) {
+  luv_codec_schema_t* sub;
+  int i;
+  luaL_checkstack(L, 4, "codec: records nested too deeply");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
+  for (i = 1; i <= self->nfields; i++) {
+    lua_rawgeti(L, -1, 2 * i - 1);
+    lua_gettable(L, -3);
+    lua_rawgeti(L, -2, 2 * i);
+    if (lua_toboolean(L, -1) && lua_type(L, -2) == LUA_TTABLE) {
+      luvL_buf_put(buf, LUV_CODEC_TREC);
+      sub = (luv_codec_schema_t*)lua_touserdata(L, -1);
+      lua_pop(L, 1);
+      encode_record(L, buf, sub, seen);
+    }
+    else {
+      lua_pop(L, 1);
+      encode_value(L, buf, -1, seen);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+static void decode_record(lua_State* L, luv_buf_t* buf, luv_codec_schema_t* self, int seen) {
+  luv_codec_schema_t* sub;
+  int i;
+  luaL_checkstack(L, 4, "codec: records nested too deeply");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
+  lua_createtable(L, 0, self->nfields);
+  for (i = 1; i <= self->nfields; i++) {
+    lua_rawgeti(L, -2, 2 * i - 1);
+    if (luvL_buf_peek(buf) == LUV_CODEC_TREC) {
+      buf->head++;
+      lua_rawgeti(L, -3, 2 * i);
+      if (!lua_toboolean(L, -1)) luaL_error(L, "codec: record doesn't match the schema");
+      sub = (luv_codec_schema_t*)lua_touserdata(L, -1);
+      lua_pop(L, 1);
+      decode_record(L, buf, sub, seen);
+    }
+    else {
+      decode_value(L, buf, seen);
+    }
+    lua_rawset(L, -3);
+  }
+  lua_remove(L, -2);
+}
+
+/* encode the top narg values into buf, starting over at its base, and
+** pop them */
+static void encode_args(lua_State* L, luv_buf_t* buf, int narg, int version) {
   int i, base, seen;
-  luv_buf_t buf; buf.base = NULL; buf.head = NULL; buf.size = 0;
 
   base = lua_gettop(L) - narg + 1;
 
@@ -426,56 +922,553 @@ int luvL_codec_encode(lua_State* L, int narg) {
   lua_insert(L, base);  /* seen */
   seen = base++;
 
-  luvL_buf_write_uleb128(&buf, narg);
+  buf->head = buf->base;
+  buf->version = version;
+  if (version >= LUV_CODEC_V2) {
+    luvL_buf_put(buf, 0);
+    luvL_buf_put(buf, (uint8_t)version);
+  }
+  luvL_buf_write_uleb128(buf, narg);
 
   for (i = base; i < base + narg; i++) {
-    encode_value(L, &buf, i, seen);
+    encode_value(L, buf, i, seen);
   }
 
   lua_remove(L, seen);
-  lua_settop(L, seen);
+  lua_settop(L, seen - 1);
+}
 
-  lua_pushlstring(L, (char *)buf.base, buf.head - buf.base);
-  luvL_buf_close(&buf);
+static int encode_shared(lua_State* L) {
+  luv_buf_t* buf = &luv_codec_buf;
+  encode_args(L, buf, lua_gettop(L), luv_codec_fmt);
+  lua_pushlstring(L, (char *)buf->base, buf->head - buf->base);
+  return 1;
+}
 
+/* the same, compressed if that makes it smaller: 0, 4, the length of the
+** message, the length of the block and the block */
+static int encode_shared_z(lua_State* L) {
+  luv_buf_t* buf = &luv_codec_buf;
+  luv_buf_t* z = &luv_codec_zbuf;
+  size_t len, zlen, mark;
+
+  encode_args(L, buf, lua_gettop(L), luv_codec_fmt);
+  len = buf->head - buf->base;
+  if (len >= LUV_CODEC_ZMIN) {
+    z->head = z->base;
+    luvL_buf_need(z, len);
+    luvL_buf_put(z, 0);
+    luvL_buf_put(z, LUV_CODEC_V2Z);
+    luvL_buf_write_uleb128(z, (uint32_t)len);
+    mark = z->head - z->base;
+    zlen = luvL_lz_compress(buf->base, len, z->head + 5, len - (mark + 5));
+    if (zlen) {
+      luvL_buf_patch_uleb128(z->head, (uint32_t)zlen);
+      z->head += 5 + zlen;
+      lua_pushlstring(L, (char *)z->base, z->head - z->base);
+      return 1;
+    }
+  }
+  lua_pushlstring(L, (char *)buf->base, len);
   return 1;
 }
 
-int luvL_codec_decode(lua_State* L) {
-  size_t len;
+/* call `encode' on the top narg values, with luv_codec_buf to itself */
+static int encode_with(lua_State* L, lua_CFunction encode, int narg) {
+  luv_buf_t save;
+  int rv, nested = luv_codec_busy;
+
+  if (nested) {
+    /* called from a __codec hook, the shared buffer is taken */
+    save = luv_codec_buf;
+    luv_codec_buf.base = NULL;
+    luv_codec_buf.head = NULL;
+    luv_codec_buf.size = 0;
+  }
+
+  /* protected, so an error can't leave the shared buffer taken */
+  luv_codec_busy = 1;
+  lua_pushcfunction(L, encode);
+  lua_insert(L, -(narg + 1));
+  rv = lua_pcall(L, narg, 1, 0);
+
+  if (nested) {
+    luvL_buf_close(&luv_codec_buf);
+    luv_codec_buf = save;
+  }
+  else {
+    luv_codec_busy = 0;
+    if (luv_codec_buf.size > LUV_CODEC_KEEP) {
+      luvL_buf_close(&luv_codec_buf);
+    }
+  }
+  if (rv) lua_error(L);
+  return 1;
+}
+
+int luvL_codec_encode(lua_State* L, int narg) {
+  return encode_with(L, encode_shared, narg);
+}
+int luvL_codec_encode_z(lua_State* L, int narg) {
+  int rv = encode_with(L, encode_shared_z, narg);
+  if (luv_codec_zbuf.size > LUV_CODEC_KEEP) {
+    luvL_buf_close(&luv_codec_zbuf);
+  }
+  return rv;
+}
+
+/* free the calling thread's encode buffer, for threads on their way out */
+void luvL_codec_release(void) {
+  luvL_buf_close(&luv_codec_buf);
+  luvL_buf_close(&luv_codec_zbuf);
+}
+
+/* a compressed message, decompressed into a userdata which is dropped
+** once the values are decoded */
+static int decode_compressed(lua_State* L, luv_buf_t* buf, size_t* used) {
+  uint32_t len = decode_uleb32(L, buf);
+  uint32_t zlen = decode_uleb32(L, buf);
+  uint8_t* data;
+  int nval, idx;
+
+  if (zlen > decode_left(buf)) decode_short(L, buf);
+  if ((uint64_t)len > (uint64_t)zlen * LUV_LZ_RATIO) {
+    luaL_error(L, "codec: corrupt compressed data");
+  }
+  if (buf->opts && buf->opts->size && len > buf->opts->size) {
+    luaL_error(L, "codec: message too large");
+  }
+  data = (uint8_t*)lua_newuserdata(L, len ? len : 1);
+  idx = lua_gettop(L);
+  if (len < 2 || !luvL_lz_decompress(buf->head, zlen, data, len)) {
+    luaL_error(L, "codec: corrupt compressed data");
+  }
+  if (data[0] == 0 && data[1] == LUV_CODEC_V2Z) {
+    luaL_error(L, "codec: compressed twice");
+  }
+  nval = luvL_codec_decode_from(L, (const char*)data, len, NULL, buf->opts);
+  lua_remove(L, idx);
+  if (used) *used = (size_t)(buf->head - buf->base) + zlen;
+  return nval;
+}
+
+/* Decode one message, `run' is NULL for a single message. In a run of
+** messages, as read by decode_many, it holds the version of the first
+** one: a v1 run has no headers, but an empty message followed by one
+** of 1 to 15 values looks like a header, so it is read as v1 */
+static int decode_message(lua_State* L, const char* data, size_t len, size_t* used,
+                          const luv_codec_opts_t* opts, int* run) {
   int nval, seen, i;
   int top = lua_gettop(L);
+  int headers = !run || *run != LUV_CODEC_V1;
+  luv_buf_t buf;
 
-  const char* data = luaL_checklstring(L, 1, &len);
-  luv_buf_t buf; buf.base = NULL; buf.head = NULL; buf.size = 0;
-
-  luvL_buf_init(&buf, (uint8_t*)data, len);
+  if (!len) return luaL_error(L, "nothing to decode");
 
+  buf.base = (uint8_t*)data;
   buf.head = buf.base;
+  buf.size = len;
+  buf.opts = opts;
+  buf.depth = 0;
+  buf.version = LUV_CODEC_V1;
+  if (opts && opts->size && len > opts->size) buf.size = opts->size;
+  if (headers && len > 1 && buf.base[0] == 0) {
+    if (buf.base[1] == LUV_CODEC_V2) {
+      buf.version = LUV_CODEC_V2;
+      buf.head += 2;
+    }
+    else if (buf.base[1] == LUV_CODEC_V2Z) {
+      if (run) *run = LUV_CODEC_V2;
+      buf.head += 2;
+      return decode_compressed(L, &buf, used);
+    }
+    else if (buf.base[1] == LUV_CODEC_V2S) {
+      return luaL_error(L, "codec: a schema record, use schema:decode");
+    }
+    else if (buf.base[1] <= LUV_CODEC_VMAX && (!run || *run == LUV_CODEC_V2)) {
+      return luaL_error(L, "codec: unknown format version %d", (int)buf.base[1]);
+    }
+  }
+  if (run && !*run) *run = buf.version;
 
   lua_newtable(L);
   seen = lua_gettop(L);
-  nval = luvL_buf_read_uleb128(&buf);
+  nval = (int)decode_uleb32(L, &buf);
+  if (opts && (size_t)nval > decode_left(&buf)) decode_short(L, &buf);
 
-  lua_checkstack(L, nval);
+  luaL_checkstack(L, nval, "too many values to decode");
 
   for (i = 0; i < nval; i++) {
     decode_value(L, &buf, seen);
   }
   lua_remove(L, seen);
 
+  if (used) *used = (size_t)(buf.head - buf.base);
   assert(lua_gettop(L) == top + nval);
   return nval;
 }
 
+/* decode one message from `len' bytes at `data', which must stay put,
+** e.g. be a string anchored on the stack. Pushes the values and returns
+** their number, the bytes read are stored in `used' if given. Untrusted
+** data is decoded with `opts', trusted data with NULL */
+int luvL_codec_decode_from(lua_State* L, const char* data, size_t len, size_t* used,
+                           const luv_codec_opts_t* opts) {
+  return decode_message(L, data, len, used, opts, NULL);
+}
+
+/* the bytes of a string or codec buffer at idx */
+static const char* codec_data(lua_State* L, int idx, size_t* len) {
+  luv_buf_t* from = (luv_buf_t*)luaL_testudata(L, idx, LUV_CODEC_BUF_T);
+  if (from) {
+    *len = from->head - from->base;
+    return (const char*)from->base;
+  }
+  return luaL_checklstring(L, idx, len);
+}
+
+/* the message at the 1-based position `pos' arg, limited to `len' arg */
+static const char* codec_range(lua_State* L, int idx, size_t* len) {
+  size_t size;
+  const char* data = codec_data(L, idx, &size);
+  lua_Integer pos = luaL_optinteger(L, idx + 1, 1);
+  lua_Integer max, n;
+  luaL_argcheck(L, pos >= 1 && (size_t)pos <= size + 1, idx + 1, "out of range");
+  max = (lua_Integer)(size - (size_t)(pos - 1));
+  n = luaL_optinteger(L, idx + 2, max);
+  luaL_argcheck(L, n >= 0 && n <= max, idx + 2, "out of range");
+  *len = (size_t)n;
+  return data + pos - 1;
+}
+
+int luvL_codec_decode(lua_State* L) {
+  size_t len;
+  const char* data = codec_data(L, 1, &len);
+  return luvL_codec_decode_from(L, data, len, NULL, NULL);
+}
+
 static int luv_codec_encode(lua_State* L) {
   return luvL_codec_encode(L, lua_gettop(L));
 }
 static int luv_codec_decode(lua_State* L) {
-  return luvL_codec_decode(L);
+  size_t len;
+  const char* data = codec_range(L, 1, &len);
+  return luvL_codec_decode_from(L, data, len, NULL, NULL);
+}
+
+/* iterator of decode_many, upvalues are the data, the next position,
+** the end and the version of the run, 0 until the first message */
+static int codec_decode_next(lua_State* L) {
+  size_t len, used;
+  const char* data = codec_data(L, lua_upvalueindex(1), &len);
+  size_t pos = (size_t)lua_tointeger(L, lua_upvalueindex(2));
+  size_t end = (size_t)lua_tointeger(L, lua_upvalueindex(3));
+  int run = (int)lua_tointeger(L, lua_upvalueindex(4));
+  int nval;
+
+  if (end > len) end = len; /* a buffer may have been reused */
+  if (pos >= end) return 0;
+
+  lua_settop(L, 0);
+  nval = decode_message(L, data + pos, end - pos, &used, NULL, &run);
+  pos += used;
+  lua_pushinteger(L, (lua_Integer)pos);
+  lua_replace(L, lua_upvalueindex(2));
+  lua_pushinteger(L, run);
+  lua_replace(L, lua_upvalueindex(4));
+
+  lua_pushinteger(L, (lua_Integer)pos + 1);
+  lua_insert(L, 1);
+  return nval + 1;
+}
+
+/* the function returned by luv.codec.decoder, its options are upvalue 1 */
+static int codec_decode_checked(lua_State* L) {
+  size_t len;
+  const char* data = codec_range(L, 1, &len);
+  luv_codec_opts_t* opts = (luv_codec_opts_t*)lua_touserdata(L, lua_upvalueindex(1));
+  return luvL_codec_decode_from(L, data, len, NULL, opts);
+}
+
+static int luv_codec_encode_z(lua_State* L) {
+  return luvL_codec_encode_z(L, lua_gettop(L));
+}
+
+/* luv.codec.encoder{ compress = bool }, returns an encode function.
+** Compressed messages are only written when they come out smaller, all
+** decode functions read both */
+static int luv_codec_encoder(lua_State* L) {
+  int compress = 0;
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "compress");
+    compress = lua_toboolean(L, -1);
+  }
+  lua_pushcfunction(L, compress ? luv_codec_encode_z : luv_codec_encode);
+  return 1;
+}
+
+/* luv.codec.decoder{ depth = n, size = n, functions = bool, hooks = bool } */
+static int luv_codec_decoder(lua_State* L) {
+  luv_codec_opts_t* opts;
+  lua_settop(L, 1);
+  opts = (luv_codec_opts_t*)lua_newuserdata(L, sizeof(luv_codec_opts_t));
+  opts->depth     = LUV_CODEC_DEPTH;
+  opts->size      = LUV_CODEC_SIZE;
+  opts->functions = 0;
+  opts->hooks     = 0;
+  if (!lua_isnil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "depth");
+    if (!lua_isnil(L, -1)) opts->depth = (int)luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "size");
+    if (!lua_isnil(L, -1)) opts->size = (size_t)luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "functions");
+    opts->functions = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "hooks");
+    opts->hooks = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pushcclosure(L, codec_decode_checked, 1);
+  return 1;
+}
+
+/* for pos, ... in luv.codec.decode_many(data[, pos[, len]]) */
+static int luv_codec_decode_many(lua_State* L) {
+  size_t len;
+  const char* data = codec_range(L, 1, &len);
+  size_t size;
+  const char* base = codec_data(L, 1, &size);
+  lua_settop(L, 1);
+  lua_pushinteger(L, (lua_Integer)(data - base));
+  lua_pushinteger(L, (lua_Integer)(data - base + len));
+  lua_pushinteger(L, 0);
+  lua_pushcclosure(L, codec_decode_next, 4);
+  return 1;
+}
+
+/* the format encode writes on this thread, 2 unless set to 1 for data
+** read by an older luv. Both are decoded */
+static int luv_codec_version(lua_State* L) {
+  if (!lua_isnoneornil(L, 1)) {
+    int version = (int)luaL_checkinteger(L, 1);
+    luaL_argcheck(L, version == LUV_CODEC_V1 || version == LUV_CODEC_V2, 1,
+      "unsupported codec version");
+    luv_codec_fmt = version;
+  }
+  lua_pushinteger(L, luv_codec_fmt);
+  return 1;
+}
+
+/* luv.codec.schema{ "key", { "key", schema }, ... } */
+static int luv_codec_schema(lua_State* L) {
+  luv_codec_schema_t* self;
+  int i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = (int)lua_rawlen(L, 1);
+  luaL_argcheck(L, n > 0, 1, "no fields");
+
+  lua_createtable(L, 2 * n, 0);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    if (lua_type(L, -1) == LUA_TTABLE) {
+      lua_rawgeti(L, -1, 1);
+      lua_rawgeti(L, -2, 2);
+      luaL_checkudata(L, -1, LUV_CODEC_SCHEMA_T);
+      lua_remove(L, -3);
+    }
+    else {
+      lua_pushboolean(L, 0);
+    }
+    if (lua_type(L, -2) != LUA_TSTRING) {
+      return luaL_error(L, "schema: field %d must be a string key", i);
+    }
+    lua_rawseti(L, -3, 2 * i);
+    lua_rawseti(L, -2, 2 * i - 1);
+  }
+
+  self = (luv_codec_schema_t*)lua_newuserdata(L, sizeof(luv_codec_schema_t));
+  self->nfields = n;
+  lua_insert(L, -2);
+  self->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  luaL_getmetatable(L, LUV_CODEC_SCHEMA_T);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int schema_encode_shared(lua_State* L) {
+  luv_buf_t* buf = &luv_codec_buf;
+  luv_codec_schema_t* self = (luv_codec_schema_t*)lua_touserdata(L, 1);
+  int seen;
+  lua_newtable(L);
+  lua_insert(L, 2);
+  seen = 2;
+
+  buf->head = buf->base;
+  buf->version = LUV_CODEC_V2;
+  luvL_buf_put(buf, 0);
+  luvL_buf_put(buf, LUV_CODEC_V2S);
+  luvL_buf_write_uleb128(buf, (uint32_t)self->nfields);
+  encode_record(L, buf, self, seen);
+
+  lua_pushlstring(L, (char *)buf->base, buf->head - buf->base);
+  return 1;
+}
+
+static int luv_codec_schema_encode(lua_State* L) {
+  luaL_checkudata(L, 1, LUV_CODEC_SCHEMA_T);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  return encode_with(L, schema_encode_shared, 2);
+}
+
+/* schema:decode(data[, pos[, len]]) */
+static int luv_codec_schema_decode(lua_State* L) {
+  luv_codec_schema_t* self = (luv_codec_schema_t*)luaL_checkudata(L, 1, LUV_CODEC_SCHEMA_T);
+  size_t len;
+  const char* data = codec_range(L, 2, &len);
+  luv_buf_t buf;
+
+  if (len < 3 || data[0] != 0 || data[1] != LUV_CODEC_V2S) {
+    return luaL_error(L, "schema: not a schema message");
+  }
+  buf.base = (uint8_t*)data;
+  buf.head = buf.base + 2;
+  buf.size = len;
+  buf.opts = NULL;
+  buf.depth = 0;
+  buf.version = LUV_CODEC_V2;
+  if (luvL_buf_read_uleb128(&buf) != (uint32_t)self->nfields) {
+    return luaL_error(L, "schema: record doesn't match the schema");
+  }
+
+  lua_newtable(L);
+  decode_record(L, &buf, self, lua_gettop(L));
+  return 1;
+}
+
+static int luv_codec_schema_free(lua_State* L) {
+  luv_codec_schema_t* self = (luv_codec_schema_t*)lua_touserdata(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, self->ref);
+  return 0;
+}
+static int luv_codec_schema_tostring(lua_State* L) {
+  luv_codec_schema_t* self = (luv_codec_schema_t*)luaL_checkudata(L, 1, LUV_CODEC_SCHEMA_T);
+  lua_pushfstring(L, "userdata<%s>: %p", LUV_CODEC_SCHEMA_T, self);
+  return 1;
+}
+
+/* luv.codec.cache([enable]), whether functions are cached on this
+** thread, disabling it drops what was cached */
+static int luv_codec_cache(lua_State* L) {
+  if (!lua_isnoneornil(L, 1)) {
+    luv_codec_nocache = !lua_toboolean(L, 1);
+    if (luv_codec_nocache) {
+      lua_pushnil(L);
+      lua_setfield(L, LUA_REGISTRYINDEX, LUV_CODEC_DUMPS);
+      lua_pushnil(L);
+      lua_setfield(L, LUA_REGISTRYINDEX, LUV_CODEC_LOADED);
+    }
+  }
+  lua_pushboolean(L, !luv_codec_nocache);
+  return 1;
+}
+
+static int luv_codec_buffer(lua_State* L) {
+  lua_Integer n = luaL_optinteger(L, 1, 0);
+  size_t size;
+  luv_buf_t* self;
+  luaL_argcheck(L, n >= 0, 1, "size must not be negative");
+  size = (size_t)n;
+  self = (luv_buf_t*)lua_newuserdata(L, sizeof(luv_buf_t));
+  self->base = NULL;
+  self->head = NULL;
+  self->size = 0;
+  luaL_getmetatable(L, LUV_CODEC_BUF_T);
+  lua_setmetatable(L, -2);
+  if (size) {
+    self->base = (uint8_t*)malloc(size);
+    if (!self->base) return luaL_error(L, "buffer: out of memory");
+    self->size = size;
+    self->head = self->base;
+  }
+  return 1;
+}
+
+/* encode into a caller's buffer, replacing what it held, saves creating
+** a string for each message. Returns the number of bytes */
+static int luv_codec_encode_into(lua_State* L) {
+  luv_buf_t* buf = (luv_buf_t*)luaL_checkudata(L, 1, LUV_CODEC_BUF_T);
+  encode_args(L, buf, lua_gettop(L) - 1, luv_codec_fmt);
+  lua_pushinteger(L, buf->head - buf->base);
+  return 1;
+}
+
+static int luv_codec_buf_size(lua_State* L) {
+  luv_buf_t* self = (luv_buf_t*)luaL_checkudata(L, 1, LUV_CODEC_BUF_T);
+  lua_pushinteger(L, self->head - self->base);
+  lua_pushinteger(L, self->size);
+  return 2;
+}
+static int luv_codec_buf_string(lua_State* L) {
+  luv_buf_t* self = (luv_buf_t*)luaL_checkudata(L, 1, LUV_CODEC_BUF_T);
+  lua_pushlstring(L, (char *)self->base, self->head - self->base);
+  return 1;
+}
+static int luv_codec_buf_clear(lua_State* L) {
+  luv_buf_t* self = (luv_buf_t*)luaL_checkudata(L, 1, LUV_CODEC_BUF_T);
+  if (lua_toboolean(L, 2)) {
+    luvL_buf_close(self);
+  }
+  else {
+    self->head = self->base;
+  }
+  return 0;
+}
+static int luv_codec_buf_free(lua_State* L) {
+  luv_buf_t* self = (luv_buf_t*)lua_touserdata(L, 1);
+  luvL_buf_close(self);
+  return 0;
+}
+static int luv_codec_buf_tostring(lua_State* L) {
+  luv_buf_t* self = (luv_buf_t*)luaL_checkudata(L, 1, LUV_CODEC_BUF_T);
+  lua_pushfstring(L, "userdata<%s>: %p", LUV_CODEC_BUF_T, self);
+  return 1;
 }
 
 luaL_Reg luv_codec_funcs[] = {
-  {"encode", luv_codec_encode},
-  {"decode", luv_codec_decode},
+  {"encode",      luv_codec_encode},
+  {"decode",      luv_codec_decode},
+  {"decode_many", luv_codec_decode_many},
+  {"decoder",     luv_codec_decoder},
+  {"encoder",     luv_codec_encoder},
+  {"buffer",      luv_codec_buffer},
+  {"encode_into", luv_codec_encode_into},
+  {"version",     luv_codec_version},
+  {"schema",      luv_codec_schema},
+  {"cache",       luv_codec_cache},
+  {"dump_file",   luvL_codec_dump_file},
+  {"load_file",   luvL_codec_load_file},
+  {NULL,          NULL}
+};
+
+luaL_Reg luv_codec_schema_meths[] = {
+  {"encode",      luv_codec_schema_encode},
+  {"decode",      luv_codec_schema_decode},
+  {"__gc",        luv_codec_schema_free},
+  {"__tostring",  luv_codec_schema_tostring},
+  {NULL,          NULL}
+};
+
+luaL_Reg luv_codec_buf_meths[] = {
+  {"size",        luv_codec_buf_size},
+  {"tostring",    luv_codec_buf_string},
+  {"clear",       luv_codec_buf_clear},
+  {"__len",       luv_codec_buf_size},
+  {"__gc",        luv_codec_buf_free},
+  {"__tostring",  luv_codec_buf_tostring},
+  {NULL,          NULL}
 };
@@ -12,9 +12,10 @@ void luvL_fiber_close(luv_fiber_t* fiber) {
 
 void luvL_fiber_ready(luv_fiber_t* fiber) {
   if (!(fiber->flags & LUV_FREADY)) {
-    TRACE("insert fiber %p into queue of %p\n", fiber, luvL_thread_self(fiber->L));
+    TRACE("insert fiber %p into queue of %p\n", fiber, fiber->outer);
     fiber->flags |= LUV_FREADY;
-    luvL_thread_enqueue(luvL_thread_self(fiber->L), fiber);
+    /* a fiber's outer state is always its thread */
+    luvL_thread_enqueue((luv_thread_t*)fiber->outer, fiber);
   }
 }
 int luvL_fiber_yield(luv_fiber_t* self, int narg) {
@@ -26,8 +27,9 @@ int luvL_fiber_suspend(luv_fiber_t* self) {
   if (self->flags & LUV_FREADY) {
     self->flags &= ~LUV_FREADY;
     if (!luvL_state_is_active((luv_state_t*)self)) {
-      ngx_queue_remove(&self->queue);
+      luvL_thread_dequeue((luv_thread_t*)self->outer, self);
     }
+    LUV_STAT(self->stats.suspends++);
     TRACE("about to yield...\n");
     return lua_yield(self->L, lua_gettop(self->L)); /* keep our stack */
   }
@@ -35,11 +37,13 @@ int luvL_fiber_suspend(luv_fiber_t* self) {
 }
 int luvL_fiber_resume(luv_fiber_t* self, lua_State* from, int narg) {
   luvL_fiber_ready(self);
+  luvL_hook_arm(self->L);
   return lua_resume(self->L, NULL, narg);
 }
 
 luv_fiber_t* luvL_fiber_create(luv_state_t* outer, int narg) {
   luv_fiber_t* self;
+  luv_thread_t* thread;
   lua_State* L = outer->L;
   int base ;
   lua_State* L1;
@@ -49,21 +53,53 @@ luv_fiber_t* luvL_fiber_create(luv_state_t* outer, int narg) {
   base = lua_gettop(L) - narg + 1;
   luaL_checktype(L, base, LUA_TFUNCTION);
 
-  L1 = lua_newthread(L);
-  lua_insert(L, base);                             /* [thread, func, ...] */
+  while (outer->type != LUV_TTHREAD) outer = outer->outer;
+  thread = (luv_thread_t*)outer;
 
-  lua_checkstack(L1, narg);
-  lua_xmove(L, L1, narg);                          /* [thread] */
+  if (!ngx_queue_empty(&thread->pool)) {
+    ngx_queue_t* q = ngx_queue_head(&thread->pool);
+    self = ngx_queue_data(q, luv_fiber_t, queue);
+    ngx_queue_remove(q);
+    thread->pool_size--;
 
-  self = (luv_fiber_t*)lua_newuserdata(L, sizeof(luv_fiber_t));
-  luaL_getmetatable(L, LUV_FIBER_T);               /* [thread, fiber, meta] */
-  lua_setmetatable(L, -2);                         /* [thread, fiber] */
+    TRACE("reuse pooled fiber: %p\n", self);
+    L1 = self->L;
 
-  lua_pushvalue(L, -1);                            /* [thread, fiber, fiber] */
-  lua_insert(L, base);                             /* [fiber, thread, fiber] */
-  lua_rawset(L, LUA_REGISTRYINDEX);                /* [fiber] */
+    /* still anchored as registry[thread] = fiber */
+    lua_pushthread(L1);
+    lua_xmove(L1, L, 1);
+    lua_rawget(L, LUA_REGISTRYINDEX);              /* [func, ..., fiber] */
 
-  while (outer->type != LUV_TTHREAD) outer = outer->outer;
+    /* resurrected in __gc, so set the metatable again to re-arm it */
+    luaL_getmetatable(L, LUV_FIBER_T);
+    lua_setmetatable(L, -2);
+    lua_insert(L, base);                           /* [fiber, func, ...] */
+
+    lua_settop(L1, 0);
+    lua_checkstack(L1, narg);
+    lua_xmove(L, L1, narg);                        /* [fiber] */
+  }
+  else {
+    L1 = lua_newthread(L);
+    lua_insert(L, base);                           /* [thread, func, ...] */
+
+    lua_checkstack(L1, narg);
+    lua_xmove(L, L1, narg);                        /* [thread] */
+
+    self = (luv_fiber_t*)lua_newuserdata(L, sizeof(luv_fiber_t));
+    luaL_getmetatable(L, LUV_FIBER_T);             /* [thread, fiber, meta] */
+    lua_setmetatable(L, -2);                       /* [thread, fiber] */
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUV_FIBER_THREADS);
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -4);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);                                 /* [thread, fiber] */
+
+    lua_pushvalue(L, -1);                          /* [thread, fiber, fiber] */
+    lua_insert(L, base);                           /* [fiber, thread, fiber] */
+    lua_rawset(L, LUA_REGISTRYINDEX);              /* [fiber] */
+  }
 
   self->type  = LUV_TFIBER;
   self->outer = outer;
@@ -71,6 +107,8 @@ luv_fiber_t* luvL_fiber_create(luv_state_t* outer, int narg) {
   self->flags = 0;
   self->data  = NULL;
   self->loop  = outer->loop;
+  self->prio  = LUV_PRIO_DEFAULT;
+  LUV_STAT(memset(&self->stats, 0, sizeof(self->stats)));
 
   /* fibers waiting for us to finish */
   ngx_queue_init(&self->rouse);
@@ -121,14 +159,96 @@ static int luv_fiber_join(lua_State* L) {
   }
 }
 
+/* luv.fiber.pool([max]) -> max, size */
+static int luv_fiber_pool(lua_State* L) {
+  luv_thread_t* thread = luvL_thread_self(L);
+  if (!lua_isnoneornil(L, 1)) {
+    thread->pool_max = luaL_checkint(L, 1);
+    while (thread->pool_size > thread->pool_max) {
+      ngx_queue_t* q = ngx_queue_head(&thread->pool);
+      luv_fiber_t* fiber = ngx_queue_data(q, luv_fiber_t, queue);
+      ngx_queue_remove(q);
+      thread->pool_size--;
+
+      /* release it to the GC */
+      lua_pushthread(fiber->L);
+      lua_xmove(fiber->L, L, 1);
+      lua_pushnil(L);
+      lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+  }
+  lua_pushinteger(L, thread->pool_max);
+  lua_pushinteger(L, thread->pool_size);
+  return 2;
+}
+
+/* fiber:priority([n]) -> n, 0 is the most urgent */
+static int luv_fiber_priority(lua_State* L) {
+  luv_fiber_t* self = (luv_fiber_t*)luaL_checkudata(L, 1, LUV_FIBER_T);
+  if (!lua_isnoneornil(L, 2)) {
+    int prio = luaL_checkint(L, 2);
+    luaL_argcheck(L, prio >= 0 && prio < LUV_NPRIO, 2, "priority out of range");
+    if (prio != self->prio) {
+      /* move it if it is waiting in a run queue */
+      int queued = (self->flags & LUV_FREADY) && !(self->flags & LUV_FDEAD)
+        && !luvL_state_is_active((luv_state_t*)self);
+      luv_thread_t* thread = (luv_thread_t*)self->outer;
+      if (queued) luvL_thread_dequeue(thread, self);
+      self->prio = prio;
+      if (queued) luvL_thread_enqueue(thread, self);
+    }
+  }
+  lua_pushinteger(L, self->prio);
+  return 1;
+}
+
+/* nil unless built with LUV_STATS */
+static int luv_fiber_stats(lua_State* L) {
+  luv_fiber_t* self = (luv_fiber_t*)luaL_checkudata(L, 1, LUV_FIBER_T);
+#ifdef LUV_STATS
+  lua_createtable(L, 0, 4);
+  lua_pushnumber(L, (lua_Number)self->stats.resumes);
+  lua_setfield(L, -2, "resumes");
+  lua_pushnumber(L, (lua_Number)self->stats.suspends);
+  lua_setfield(L, -2, "suspends");
+  lua_pushnumber(L, (lua_Number)self->stats.run_time);
+  lua_setfield(L, -2, "run_time");
+  lua_pushnumber(L, (lua_Number)self->stats.wait_time);
+  lua_setfield(L, -2, "wait_time");
+#else
+  (void)self;
+  lua_pushnil(L);
+#endif
+  return 1;
+}
+
 static int luv_fiber_ready(lua_State* L) {
   luv_fiber_t* self = (luv_fiber_t*)lua_touserdata(L, 1);
   luvL_fiber_ready(self);
   return 1;
 }
 static int luv_fiber_free(lua_State* L) {
-  luv_fiber_t* self = (luv_fiber_t*)lua_touserdata(L, 1);
-  if (self->data) free(self->data);
+  luv_fiber_t*  self = (luv_fiber_t*)lua_touserdata(L, 1);
+  luv_thread_t* thread = (luv_thread_t*)self->outer;
+  if (self->data) {
+    free(self->data);
+    self->data = NULL;
+  }
+  /* only coroutines which returned normally can be resumed again */
+  if ((self->flags & LUV_FDEAD) && lua_status(self->L) == 0
+    && thread->pool_size < thread->pool_max) {
+    TRACE("recycle fiber: %p\n", self);
+    lua_settop(self->L, 0);
+
+    /* resurrect it, registry[thread] = fiber */
+    lua_pushthread(self->L);
+    lua_xmove(self->L, L, 1);
+    lua_pushvalue(L, 1);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    ngx_queue_insert_tail(&thread->pool, &self->queue);
+    thread->pool_size++;
+  }
   return 1;
 }
 static int luv_fiber_tostring(lua_State* L) {
@@ -139,12 +259,15 @@ static int luv_fiber_tostring(lua_State* L) {
 
 luaL_Reg luv_fiber_funcs[] = {
   {"create",    luv_new_fiber},
+  {"pool",      luv_fiber_pool},
   {NULL,        NULL}
 };
 
 luaL_Reg luv_fiber_meths[] = {
   {"join",      luv_fiber_join},
   {"ready",     luv_fiber_ready},
+  {"priority",  luv_fiber_priority},
+  {"stats",     luv_fiber_stats},
   {"__gc",      luv_fiber_free},
   {"__tostring",luv_fiber_tostring},
   {NULL,        NULL}
@@ -79,6 +79,10 @@ static void luv_push_stats_table(lua_State* L, struct stat* s) {
 static void luv_fs_result(lua_State* L, uv_fs_t* req) {
   TRACE("enter fs result...\n");
   if (req->result == -1) {
+    if (req->fs_type == UV_FS_READ) {
+      luvL_free(req->data);
+      req->data = NULL;
+    }
     lua_pushnil(L);
     lua_pushinteger(L, (uv_err_code)req->errorno);
   }
@@ -113,7 +117,7 @@ static void luv_fs_result(lua_State* L, uv_fs_t* req) {
       case UV_FS_READ:
         lua_pushinteger(L, req->result);
         lua_pushlstring(L, (const char*)req->data, req->result);
-        free(req->data);
+        luvL_free(req->data);
         req->data = NULL;
         break;
 
@@ -387,7 +391,7 @@ static int luv_file_read(lua_State *L) {
 
   size_t  len = luaL_optint(L, 2, LUV_BUF_SIZE);
   int64_t ofs = luaL_optint(L, 3, -1);
-  void*   buf = malloc(len); /* free from ctx->req.fs_req.data in cb */
+  void*   buf = luvL_alloc(len); /* free from ctx->req.fs_req.data in cb */
 
   lua_settop(L, 0);
   LUV_FS_CALL(L, read, buf, self->h.file, buf, len, ofs);
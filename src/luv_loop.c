@@ -0,0 +1,263 @@
+#include "luv.h"
+#include <stdio.h>
+
+/* Loop lag and stall detection. A prepare/check pair brackets each poll
+** of a thread's loop: the time from a check (poll returned) to the next
+** prepare (about to poll) is how long callbacks and fibers held the loop,
+** which goes into a histogram. Both bump `turns', so it is odd while the
+** loop is blocked in poll, which the watchdog uses to tell an idle loop
+** from a stalled one. */
+
+struct luv_watchdog_s {
+  luv_thread_t*   thread;
+  uv_thread_t     tid;
+  uv_mutex_t      lock;
+  uv_cond_t       cond;
+  int             stop;
+  uint64_t        limit;  /* ns without a turn before reporting */
+  unsigned long   stalls;
+  uint64_t        since;  /* start of the stall being reported */
+  volatile int    stalled; /* raised by the watchdog, taken by the hook */
+};
+
+/* instructions between two runs of the hook */
+#define LUV_HOOK_COUNT 1000
+
+static void _hist_add(luv_hist_t* h, uint64_t v) {
+  int idx;
+  if (v < LUV_HIST_SUB) {
+    idx = (int)v;
+  }
+  else {
+    int msb = 0, shift;
+    uint64_t x = v;
+    while (x >>= 1) msb++;
+    shift = msb - 4; /* log2(LUV_HIST_SUB) */
+    idx = (shift + 1) * LUV_HIST_SUB + (int)((v >> shift) - LUV_HIST_SUB);
+    if (idx >= LUV_HIST_BUCKETS) idx = LUV_HIST_BUCKETS - 1;
+  }
+  h->buckets[idx]++;
+  if (!h->count || v < h->min) h->min = v;
+  if (v > h->max) h->max = v;
+  h->count++;
+  h->sum += v;
+}
+
+/* highest value counted in bucket `idx' */
+static uint64_t _hist_value(int idx) {
+  int shift;
+  if (idx < LUV_HIST_SUB) return (uint64_t)idx;
+  shift = idx / LUV_HIST_SUB - 1;
+  return ((uint64_t)(LUV_HIST_SUB + idx % LUV_HIST_SUB + 1) << shift) - 1;
+}
+
+static uint64_t _hist_quantile(luv_hist_t* h, double q) {
+  uint64_t rank = (uint64_t)(q * (double)h->count + 0.5);
+  uint64_t seen = 0;
+  int idx;
+  if (rank < 1) rank = 1;
+  for (idx = 0; idx < LUV_HIST_BUCKETS; idx++) {
+    seen += h->buckets[idx];
+    if (seen >= rank) {
+      uint64_t v = _hist_value(idx);
+      return v > h->max ? h->max : v;
+    }
+  }
+  return h->max;
+}
+
+static void _prepare_cb(uv_prepare_t* handle, int status) {
+  luv_thread_t* self = container_of(handle, luv_thread_t, prepare);
+  (void)status;
+  if (self->polled) {
+    _hist_add(&self->lag, (uv_hrtime() - self->polled) / 1000);
+  }
+  self->turns++;
+}
+
+static void _check_cb(uv_check_t* handle, int status) {
+  luv_thread_t* self = container_of(handle, luv_thread_t, check);
+  (void)status;
+  self->polled = uv_hrtime();
+  self->turns++;
+}
+
+void luvL_lag_init(luv_thread_t* self) {
+  memset(&self->lag, 0, sizeof(self->lag));
+  self->polled   = 0;
+  self->turns    = 0;
+  self->watchdog = NULL;
+
+  uv_prepare_init(self->loop, &self->prepare);
+  uv_prepare_start(&self->prepare, _prepare_cb);
+  uv_unref((uv_handle_t*)&self->prepare);
+
+  uv_check_init(self->loop, &self->check);
+  uv_check_start(&self->check, _check_cb);
+  uv_unref((uv_handle_t*)&self->check);
+}
+
+/* report a stall, in the stalled thread as soon as it runs Lua again */
+static void _watchdog_report(lua_State* L, luv_watchdog_t* self) {
+  self->stalled = 0;
+  luaL_traceback(L, L, lua_pushfstring(L,
+    "luv: event loop stalled for %d ms, in state %p",
+    (int)((uv_hrtime() - self->since) / 1000000), luvL_state_self(L)
+  ), 0);
+  fprintf(stderr, "%s\n", lua_tostring(L, -1));
+  lua_pop(L, 2);
+}
+
+/* The count hook shared by the watchdog and the profiler. Their OS threads
+** only raise flags, a thread sets the hook on its own states, see
+** luvL_hook_arm, and the hook acts on the flags. */
+static void _hook(lua_State* L, lua_Debug* ar) {
+  luv_thread_t* thread = luvL_thread_current;
+  int active = 0;
+  (void)ar;
+  if (luvL_profiler_active()) {
+    active = 1;
+    luvL_profiler_sample(L);
+  }
+  if (thread && thread->watchdog) {
+    active = 1;
+    if (thread->watchdog->stalled) _watchdog_report(L, thread->watchdog);
+  }
+  /* left on a state after both stopped */
+  if (!active) lua_sethook(L, NULL, 0, 0);
+}
+
+/* called by a thread before it runs L */
+void luvL_hook_arm(lua_State* L) {
+  luv_thread_t* thread = luvL_thread_current;
+  if (luvL_profiler_active() || (thread && thread->watchdog)) {
+    lua_sethook(L, _hook, LUA_MASKCOUNT, LUV_HOOK_COUNT);
+  }
+  else if (lua_gethook(L) == _hook) {
+    lua_sethook(L, NULL, 0, 0);
+  }
+}
+
+static void _watchdog_enter(void* arg) {
+  luv_watchdog_t* self = (luv_watchdog_t*)arg;
+  luv_thread_t* thread = self->thread;
+  unsigned long turns = thread->turns;
+  uint64_t moved = uv_hrtime();
+  uint64_t period = self->limit / 4;
+  int reported = 0;
+
+  if (period < 1000000) period = 1000000;
+
+  uv_mutex_lock(&self->lock);
+  while (!self->stop) {
+    uint64_t now;
+    uv_cond_timedwait(&self->cond, &self->lock, period);
+    if (self->stop) break;
+
+    now = uv_hrtime();
+    if (thread->turns != turns || (turns & 1)) {
+      /* turned, or idle in poll */
+      turns    = thread->turns;
+      moved    = now;
+      reported = 0;
+    }
+    else if (!reported && now - moved > self->limit) {
+      reported = 1;
+      self->stalls++;
+      self->since = moved;
+      fprintf(stderr, "luv: event loop of thread %p has not turned for %d ms\n",
+        (void*)thread, (int)((now - moved) / 1000000));
+      /* ask the thread's hook for a traceback of whatever holds the loop */
+      self->stalled = 1;
+    }
+  }
+  uv_mutex_unlock(&self->lock);
+}
+
+void luvL_watchdog_stop(luv_thread_t* thread) {
+  luv_watchdog_t* self = thread->watchdog;
+  if (!self) return;
+  uv_mutex_lock(&self->lock);
+  self->stop = 1;
+  uv_cond_signal(&self->cond);
+  uv_mutex_unlock(&self->lock);
+  uv_thread_join(&self->tid);
+  uv_cond_destroy(&self->cond);
+  uv_mutex_destroy(&self->lock);
+  thread->watchdog = NULL;
+  free(self);
+}
+
+/* Lua API */
+static int luv_loop_lag(lua_State* L) {
+  luv_thread_t* thread = luvL_thread_self(L);
+  luv_hist_t* h = &thread->lag;
+  int reset = lua_toboolean(L, 1);
+
+  lua_createtable(L, 0, 9);
+  lua_pushnumber(L, (lua_Number)h->count);
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, (lua_Number)h->min / 1000);
+  lua_setfield(L, -2, "min");
+  lua_pushnumber(L, (lua_Number)h->max / 1000);
+  lua_setfield(L, -2, "max");
+  lua_pushnumber(L, h->count ? (lua_Number)h->sum / h->count / 1000 : 0);
+  lua_setfield(L, -2, "mean");
+  if (h->count) {
+    lua_pushnumber(L, (lua_Number)_hist_quantile(h, 0.5) / 1000);
+    lua_setfield(L, -2, "p50");
+    lua_pushnumber(L, (lua_Number)_hist_quantile(h, 0.9) / 1000);
+    lua_setfield(L, -2, "p90");
+    lua_pushnumber(L, (lua_Number)_hist_quantile(h, 0.99) / 1000);
+    lua_setfield(L, -2, "p99");
+    lua_pushnumber(L, (lua_Number)_hist_quantile(h, 0.999) / 1000);
+    lua_setfield(L, -2, "p999");
+  }
+  lua_pushnumber(L, thread->watchdog ? (lua_Number)thread->watchdog->stalls : 0);
+  lua_setfield(L, -2, "stalls");
+
+  if (reset) memset(h, 0, sizeof(*h));
+  return 1;
+}
+
+static int luv_loop_watchdog(lua_State* L) {
+  luv_thread_t* thread = luvL_thread_self(L);
+  lua_Number limit = luaL_optnumber(L, 1, 0);
+  luv_watchdog_t* self;
+
+  luvL_watchdog_stop(thread);
+  if (limit <= 0) {
+    luvL_hook_arm(L);
+    luvL_hook_arm(thread->L);
+    return 0;
+  }
+
+  self = (luv_watchdog_t*)malloc(sizeof(luv_watchdog_t));
+  self->thread = thread;
+  self->stop   = 0;
+  self->limit  = (uint64_t)(limit * 1000000);
+  self->stalls = 0;
+  self->since  = 0;
+  self->stalled = 0;
+  uv_mutex_init(&self->lock);
+  uv_cond_init(&self->cond);
+
+  thread->watchdog = self;
+  if (uv_thread_create(&self->tid, _watchdog_enter, self)) {
+    thread->watchdog = NULL;
+    uv_cond_destroy(&self->cond);
+    uv_mutex_destroy(&self->lock);
+    free(self);
+    return luaL_error(L, "failed to start the watchdog thread");
+  }
+  luvL_hook_arm(L);
+  luvL_hook_arm(thread->L);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+luaL_Reg luv_loop_funcs[] = {
+  {"lag",       luv_loop_lag},
+  {"watchdog",  luv_loop_watchdog},
+  {NULL,        NULL}
+};
@@ -0,0 +1,147 @@
+#include "luv.h"
+
+#include <stdint.h>
+
+/* A small LZ77 block compressor in the manner of LZ4. A block is a run
+** of sequences, each a token byte holding the literal length in its high
+** and the match length less 4 in its low nibble (15 meaning more length
+** bytes follow, added up until one isn't 255), the literals, then a 2
+** byte little endian offset back into the output. The last sequence has
+** literals only and ends the block. */
+
+#define LUV_LZ_MINMATCH 4
+#define LUV_LZ_MAXOFF   65535
+#define LUV_LZ_HASHLOG  12
+
+static LUV_THREAD_LOCAL uint32_t luv_lz_table[1 << LUV_LZ_HASHLOG];
+
+static uint32_t _read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static uint32_t _hash(uint32_t v, int bits) {
+  return (v * 2654435761U) >> (32 - bits);
+}
+
+/* a length in the token nibble and the bytes after it */
+static uint8_t* _put_len(uint8_t* op, size_t n) {
+  for (n -= 15; n >= 255; n -= 255) *op++ = 255;
+  *op++ = (uint8_t)n;
+  return op;
+}
+
+static uint8_t* _put_seq(uint8_t* op, uint8_t* oend, const uint8_t* lit, size_t nlit,
+                         size_t off, size_t nmatch) {
+  uint8_t* token;
+  /* the worst case for the lengths, so only one check is needed */
+  if ((size_t)(oend - op) < nlit + nlit / 255 + nmatch / 255 + 7) return NULL;
+  token = op++;
+
+  *token = (uint8_t)((nlit >= 15 ? 15 : nlit) << 4);
+  if (nlit >= 15) op = _put_len(op, nlit);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (!nmatch) return op;
+
+  *op++ = (uint8_t)(off & 0xff);
+  *op++ = (uint8_t)(off >> 8);
+  nmatch -= LUV_LZ_MINMATCH;
+  *token |= (uint8_t)(nmatch >= 15 ? 15 : nmatch);
+  if (nmatch >= 15) op = _put_len(op, nmatch);
+  return op;
+}
+
+/* compress `len' bytes into at most `cap', returns the compressed size,
+** or 0 if it didn't fit */
+size_t luvL_lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+  const uint8_t* ip = src;
+  const uint8_t* anchor = src;
+  const uint8_t* end = src + len;
+  uint8_t* op = dst;
+  uint8_t* oend = dst + cap;
+  int bits = 8;
+
+  /* a table no bigger than the input needs, it is cleared each time */
+  while (bits < LUV_LZ_HASHLOG && ((size_t)1 << bits) < len) bits++;
+  memset(luv_lz_table, 0, sizeof(uint32_t) << bits);
+
+  while (ip + LUV_LZ_MINMATCH <= end) {
+    uint32_t seq = _read32(ip);
+    uint32_t h = _hash(seq, bits);
+    const uint8_t* ref = src + luv_lz_table[h];
+    luv_lz_table[h] = (uint32_t)(ip - src);
+
+    if (ref < ip && ip - ref <= LUV_LZ_MAXOFF && _read32(ref) == seq) {
+      const uint8_t* mp = ip + LUV_LZ_MINMATCH;
+      const uint8_t* rp = ref + LUV_LZ_MINMATCH;
+      while (mp < end && *mp == *rp) {
+        mp++;
+        rp++;
+      }
+      op = _put_seq(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref),
+                    (size_t)(mp - ip));
+      if (!op) return 0;
+      ip = anchor = mp;
+    }
+    else {
+      /* step faster through data which doesn't compress */
+      ip += 1 + ((size_t)(ip - anchor) >> 6);
+    }
+  }
+
+  op = _put_seq(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+  return op ? (size_t)(op - dst) : 0;
+}
+
+static int _get_len(const uint8_t** ip, const uint8_t* iend, size_t* n) {
+  uint8_t b;
+  do {
+    if (*ip >= iend) return 0;
+    b = *(*ip)++;
+    *n += b;
+    if (*n > (size_t)-1 / 2) return 0;
+  } while (b == 255);
+  return 1;
+}
+
+/* decompress a block into exactly `cap' bytes, returns 0 if the block
+** is corrupt or doesn't come out at that size */
+int luvL_lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+  const uint8_t* ip = src;
+  const uint8_t* iend = src + len;
+  uint8_t* op = dst;
+  uint8_t* oend = dst + cap;
+
+  for (;;) {
+    const uint8_t* ref;
+    size_t n, off;
+    uint8_t token;
+
+    if (ip >= iend) return 0;
+    token = *ip++;
+
+    n = token >> 4;
+    if (n == 15 && !_get_len(&ip, iend, &n)) return 0;
+    if (n > (size_t)(iend - ip) || n > (size_t)(oend - op)) return 0;
+    memcpy(op, ip, n);
+    op += n;
+    ip += n;
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return 0;
+    off = (size_t)ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (!off || off > (size_t)(op - dst)) return 0;
+
+    n = token & 15;
+    if (n == 15 && !_get_len(&ip, iend, &n)) return 0;
+    n += LUV_LZ_MINMATCH;
+    if (n > (size_t)(oend - op)) return 0;
+    /* may overlap, which repeats the last `off' bytes */
+    ref = op - off;
+    while (n--) *op++ = *ref++;
+  }
+  return op == oend;
+}
@@ -1,15 +1,33 @@
 #include "luv.h"
 #include <string.h>
+#include <errno.h>
 
+#ifndef WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+/* luv.net.tcp([{ reuseport = true }]) */
 static int luv_new_tcp(lua_State* L) {
   luv_state_t*  curr = luvL_state_self(L);
-  luv_object_t* self = (luv_object_t*)lua_newuserdata(L, sizeof(luv_object_t));
+  luv_object_t* self;
+  int reuseport = 0;
+
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "reuseport");
+    reuseport = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  self = (luv_object_t*)lua_newuserdata(L, sizeof(luv_object_t));
   luaL_getmetatable(L, LUV_NET_TCP_T);
   lua_setmetatable(L, -2);
 
   luvL_object_init(curr, self);
 
   uv_tcp_init(luvL_event_loop(L), &self->h.tcp);
+  if (reuseport) self->flags |= LUV_OREUSEPORT;
   return 1;
 }
 
@@ -118,6 +136,33 @@ static int luv_getaddrinfo(lua_State* L) {
   return luvL_state_suspend(curr);
 }
 
+/* libuv has no SO_REUSEPORT option, so we make and bind the socket
+** ourselves and hand it over with uv_tcp_open */
+static int _tcp_bind_reuseport(luv_object_t* self, struct sockaddr_in addr) {
+#if !defined(WIN32) && defined(SO_REUSEPORT)
+  int on = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)
+   || fcntl(fd, F_SETFD, FD_CLOEXEC)
+   || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+   || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))
+   || bind(fd, (struct sockaddr*)&addr, sizeof(addr))
+   || uv_tcp_open(&self->h.tcp, fd)) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return 0;
+#else
+  (void)self;
+  (void)addr;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
 static int luv_tcp_bind(lua_State* L) {
   luv_object_t *self = (luv_object_t*)luaL_checkudata(L, 1, LUV_NET_TCP_T);
 
@@ -129,6 +174,16 @@ static int luv_tcp_bind(lua_State* L) {
   port = luaL_checkint(L, 3);
   addr = uv_ip4_addr(host, port);
 
+  if (self->flags & LUV_OREUSEPORT) {
+    rv = _tcp_bind_reuseport(self, addr);
+    lua_pushinteger(L, rv);
+    if (rv) {
+      lua_pushfstring(L, "bind: %s", strerror(errno));
+      return 2;
+    }
+    return 1;
+  }
+
   rv = uv_tcp_bind(&self->h.tcp, addr);
   lua_pushinteger(L, rv);
 
@@ -271,6 +326,124 @@ static int luv_tcp_tostring(lua_State *L) {
   return 1;
 }
 
+/* entry of each luv.net.serve thread, called with the luv module since
+** it has no globals to find it in */
+static const char* LUV_NET_SERVE_MAIN =
+  "local luv, host, port, backlog, handler = ...\n"
+  "local server = luv.net.tcp{ reuseport = true }\n"
+  "local rv, err = server:bind(host, port)\n"
+  "if rv ~= 0 then return nil, err end\n"
+  "server:listen(backlog)\n"
+  "while true do\n"
+  "  local client = luv.net.tcp()\n"
+  "  if server:accept(client) then\n"
+  "    luv.fiber.create(handler, client):ready()\n"
+  "  end\n"
+  "end\n";
+
+/* luv.net.serve(n, host, port, handler[, backlog]) */
+static int luv_net_serve(lua_State* L) {
+  luv_state_t* curr = luvL_state_self(L);
+  int nthreads = luaL_checkint(L, 1);
+  int backlog  = luaL_optint(L, 5, 128);
+  int i;
+
+  luaL_checkstring(L, 2);
+  luaL_checkinteger(L, 3);
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+  luaL_argcheck(L, nthreads > 0, 1, "need at least one thread");
+  lua_settop(L, 4);
+
+  if (luaL_loadbuffer(L, LUV_NET_SERVE_MAIN, strlen(LUV_NET_SERVE_MAIN), "=luv.net.serve")) {
+    return lua_error(L);
+  }
+  /* it uses no globals, so don't send them along with it */
+  lua_newtable(L);
+  if (!lua_setupvalue(L, -2, 1)) lua_pop(L, 1);
+
+  lua_createtable(L, nthreads, 0);
+  for (i = 1; i <= nthreads; i++) {
+    lua_pushvalue(L, 5);                        /* entry */
+    lua_getfield(L, LUA_REGISTRYINDEX, "luv");  /* luv */
+    lua_pushvalue(L, 2);                        /* host */
+    lua_pushvalue(L, 3);                        /* port */
+    lua_pushinteger(L, backlog);
+    lua_pushvalue(L, 4);                        /* handler */
+    luvL_thread_create(curr, 6);
+    lua_rawseti(L, -2, i);
+  }
+  return 1;
+}
+
+/* luv.net.dispatch is written in Lua so that it may suspend the calling
+** fiber. Connections go to the worker with the fewest unfinished ones
+** over an IPC pipe, and workers write a byte back on it for each
+** connection their handler is done with. The thread entries don't use
+** globals, see luv.net.serve */
+static const char* LUV_NET_DISPATCH_MAIN =
+  "local luv = ...\n"
+  "local worker = function(luv, ipc, handler)\n"
+  "  while true do\n"
+  "    local client = luv.net.tcp()\n"
+  "    if not ipc:accept(client) then return end\n"
+  "    luv.fiber.create(function()\n"
+  "      handler(client)\n"
+  "      ipc:write('d')\n"
+  "    end):ready()\n"
+  "  end\n"
+  "end\n"
+  "local acceptor = function(luv, host, port, backlog, ipcs)\n"
+  "  local load = { }\n"
+  "  for i=1, #ipcs do\n"
+  "    load[i] = 0\n"
+  "    luv.fiber.create(function()\n"
+  "      while true do\n"
+  "        local got, str = ipcs[i]:read()\n"
+  "        if not got then break end\n"
+  "        load[i] = load[i] - #str\n"
+  "      end\n"
+  "    end):ready()\n"
+  "  end\n"
+  "  local server = luv.net.tcp()\n"
+  "  if server:bind(host, port) ~= 0 then return nil, 'bind failed' end\n"
+  "  server:listen(backlog)\n"
+  "  while true do\n"
+  "    local client = luv.net.tcp()\n"
+  "    if server:accept(client) then\n"
+  "      local best = 1\n"
+  "      for i=2, #ipcs do\n"
+  "        if load[i] < load[best] then best = i end\n"
+  "      end\n"
+  "      load[best] = load[best] + 1\n"
+  "      ipcs[best]:write('h', client)\n"
+  "      client:close()\n"
+  "    end\n"
+  "  end\n"
+  "end\n"
+  "return function(n, host, port, handler, backlog)\n"
+  "  assert(n > 0, 'need at least one worker')\n"
+  "  local threads, ends = { }, { }\n"
+  "  for i=1, n do\n"
+  "    local a, b = luv.pipe.pair(true)\n"
+  "    threads[i + 1] = luv.thread.spawn(worker, luv, b, handler)\n"
+  "    b:close()\n"
+  "    ends[i] = a\n"
+  "  end\n"
+  "  threads[1] = luv.thread.spawn(acceptor, luv, host, port, backlog or 128, ends)\n"
+  "  for i=1, n do ends[i]:close() end\n"
+  "  return threads\n"
+  "end\n";
+
+/* pushes luv.net.dispatch, given the luv module on top */
+int luvL_net_dispatch(lua_State* L) {
+  if (luaL_loadbuffer(L, LUV_NET_DISPATCH_MAIN, strlen(LUV_NET_DISPATCH_MAIN), "=luv.net.dispatch")) {
+    return lua_error(L);
+  }
+  lua_insert(L, -2);
+  lua_call(L, 1, 1);
+  return 1;
+}
+
 static int luv_new_udp(lua_State* L) {
   luv_state_t*  curr = luvL_state_self(L);
   luv_object_t* self = (luv_object_t*)lua_newuserdata(L, sizeof(luv_object_t));
@@ -338,7 +511,7 @@ static void _recv_cb(uv_udp_t* handle, ssize_t nread, uv_buf_t buf, struct socka
     s = ngx_queue_data(q, luv_state_t, cond);
 
     lua_settop(s->L, 0);
-    lua_pushlstring(s->L, buf.base, buf.len);
+    lua_pushlstring(s->L, buf.base, nread < 0 ? 0 : nread);
 
     if (peer->sa_family == PF_INET) {
       struct sockaddr_in* addr = (struct sockaddr_in*)peer;
@@ -355,6 +528,7 @@ static void _recv_cb(uv_udp_t* handle, ssize_t nread, uv_buf_t buf, struct socka
     lua_pushinteger(s->L, port);
     /* [ mesg, host, port ] */
   }
+  luvL_free(buf.base);
   luvL_cond_signal(&self->rouse);
 }
 
@@ -400,6 +574,7 @@ luaL_Reg luv_net_funcs[] = {
   {"tcp",         luv_new_tcp},
   {"udp",         luv_new_udp},
   {"getaddrinfo", luv_getaddrinfo},
+  {"serve",       luv_net_serve},
   {NULL,          NULL}
 };
 
@@ -9,6 +9,7 @@ void luvL_object_init(luv_state_t* state, luv_object_t* self) {
   self->count = 0;
   self->buf.base = NULL;
   self->buf.len  = 0;
+  self->passed   = NULL;
 }
 
 void luvL_object_close_cb(uv_handle_t* handle) {
@@ -1,18 +1,50 @@
 #include "luv.h"
+#include <errno.h>
 
-static int luv_new_pipe(lua_State* L) {
+#ifndef WIN32
+#include <sys/socket.h>
+#include <fcntl.h>
+#endif
+
+static luv_object_t* _pipe_new(lua_State* L, int ipc) {
   luv_object_t* self = (luv_object_t*)lua_newuserdata(L, sizeof(luv_object_t));
-  int ipc = 0;
   luaL_getmetatable(L, LUV_PIPE_T);
   lua_setmetatable(L, -2);
-  if (!lua_isnoneornil(L, 2)) {
-    luaL_checktype(L, 2, LUA_TBOOLEAN);
-    ipc = lua_toboolean(L, 2);
-  }
+  luvL_object_init(luvL_state_self(L), self);
   uv_pipe_init(luvL_event_loop(L), &self->h.pipe, ipc);
+  return self;
+}
+
+static int luv_new_pipe(lua_State* L) {
+  int ipc = 0;
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TBOOLEAN);
+    ipc = lua_toboolean(L, 1);
+  }
+  _pipe_new(L, ipc);
   return 1;
 }
 
+/* luv.pipe.pair([ipc]), two connected pipes on a socketpair */
+static int luv_pipe_pair(lua_State* L) {
+#ifndef WIN32
+  int ipc = lua_toboolean(L, 1);
+  int fds[2], i;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    return luaL_error(L, "socketpair: %s", strerror(errno));
+  }
+  for (i = 0; i < 2; i++) {
+    luv_object_t* self = _pipe_new(L, ipc);
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    uv_pipe_open(&self->h.pipe, fds[i]);
+  }
+  return 2;
+#else
+  return luaL_error(L, "luv.pipe.pair is not supported on this platform");
+#endif
+}
+
 static int luv_pipe_open(lua_State* L) {
   luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_PIPE_T);
   uv_file fh;
@@ -57,6 +89,7 @@ static int luv_pipe_tostring(lua_State *L) {
 
 luaL_Reg luv_pipe_funcs[] = {
   {"create",      luv_new_pipe},
+  {"pair",        luv_pipe_pair},
   {NULL,          NULL}
 };
 
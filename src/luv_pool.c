@@ -0,0 +1,471 @@
+#include "luv.h"
+
+/* Thread pool. Each worker is a luv thread set up once, with its own Lua
+** state, loop and async handle, which runs encoded tasks and hands the
+** encoded results back to the thread owning the pool. Tasks are queued
+** on the workers round-robin, and a worker whose queue is empty steals
+** from the tail of the others'. */
+
+typedef struct luv_pool_s luv_pool_t;
+
+typedef struct luv_task_s {
+  ngx_queue_t     queue;    /* in a worker's queue, then the done list */
+  ngx_queue_t     rouse;    /* joining states */
+  int             flags;
+  char*           data;     /* encoded function and args, then results */
+  size_t          len;
+} luv_task_t;
+
+typedef struct luv_worker_s {
+  luv_thread_t    thread;
+  luv_pool_t*     pool;
+  int             index;
+  uv_mutex_t      lock;
+  ngx_queue_t     tasks;
+} luv_worker_t;
+
+struct luv_pool_s {
+  luv_thread_t*   owner;
+  luv_worker_t*   workers;
+  int             size;
+  int             next;     /* worker for the next submit */
+  uv_mutex_t      lock;     /* guards pending, stop and done */
+  uv_cond_t       cond;
+  unsigned int    pending;  /* queued tasks no worker has claimed */
+  int             stop;
+  int             running;  /* workers which haven't exited yet */
+  ngx_queue_t     done;
+  uv_async_t      async;    /* on the owner's loop, sent when done */
+  unsigned int    active;   /* submitted and not delivered yet */
+  ngx_queue_t     rouse;    /* states waiting in close */
+};
+
+/* block until a task is queued, NULL once the pool is stopped and empty */
+static luv_task_t* _pool_take(luv_worker_t* self) {
+  luv_pool_t* pool = self->pool;
+  luv_task_t* task = NULL;
+  int i;
+
+  uv_mutex_lock(&pool->lock);
+  while (!pool->pending && !pool->stop) {
+    uv_cond_wait(&pool->cond, &pool->lock);
+  }
+  if (!pool->pending) {
+    uv_mutex_unlock(&pool->lock);
+    return NULL;
+  }
+  pool->pending--;
+  uv_mutex_unlock(&pool->lock);
+
+  /* one of the queued tasks is ours now: own queue first, then steal */
+  for (i = 0; !task; i++) {
+    luv_worker_t* w = &pool->workers[(self->index + i) % pool->size];
+    uv_mutex_lock(&w->lock);
+    if (!ngx_queue_empty(&w->tasks)) {
+      ngx_queue_t* q = w == self
+        ? ngx_queue_head(&w->tasks)
+        : ngx_queue_last(&w->tasks);
+      ngx_queue_remove(q);
+      task = ngx_queue_data(q, luv_task_t, queue);
+    }
+    uv_mutex_unlock(&w->lock);
+  }
+  return task;
+}
+
+static int _pool_encode(lua_State* L) {
+  luvL_codec_encode(L, lua_gettop(L));
+  return 1;
+}
+
+static void _pool_enter(void* arg) {
+  luv_worker_t* self = (luv_worker_t*)arg;
+  luv_thread_t* thread = &self->thread;
+  luv_pool_t*   pool = self->pool;
+  lua_State*    L = thread->L;
+  luv_task_t*   task;
+
+  luvL_thread_current = thread;
+  while ((task = _pool_take(self))) {
+    const char* data;
+    size_t len;
+
+    lua_settop(L, 0);
+    lua_pushlstring(L, task->data, task->len);
+    free(task->data);
+    luvL_thread_run(thread);
+
+    /* let fibers started by the task finish before the next one */
+    luvL_thread_suspend(thread);
+
+    lua_pushcfunction(L, _pool_encode);
+    lua_insert(L, 1);
+    if (lua_pcall(L, lua_gettop(L) - 1, 1, 0)) {
+      lua_pushboolean(L, 0);
+      lua_insert(L, 1);
+      luvL_codec_encode(L, 2);
+    }
+    data = lua_tolstring(L, -1, &len);
+    task->data = (char*)malloc(len);
+    task->len  = len;
+    memcpy(task->data, data, len);
+    lua_settop(L, 0);
+
+    uv_mutex_lock(&pool->lock);
+    ngx_queue_insert_tail(&pool->done, &task->queue);
+    uv_mutex_unlock(&pool->lock);
+    uv_async_send(&pool->async);
+  }
+
+  luvL_chan_detach(thread);
+  luvL_watchdog_stop(thread);
+  luvL_codec_release();
+
+  /* the owner joins us once all workers are out */
+  uv_mutex_lock(&pool->lock);
+  pool->running--;
+  uv_mutex_unlock(&pool->lock);
+  uv_async_send(&pool->async);
+}
+
+static int _task_decode(lua_State* L) {
+  luv_task_t* self = (luv_task_t*)lua_touserdata(L, 1);
+  lua_pop(L, 1);
+  /* the data is the task's until it is collected */
+  return luvL_codec_decode_from(L, self->data, self->len, NULL, NULL);
+}
+
+/* push the results of a finished task onto the stack of L, decoded on
+** RL, the running state, as L may be a suspended fiber */
+static int _task_results(luv_task_t* self, lua_State* RL, lua_State* L) {
+  int base = lua_gettop(RL);
+  int nret;
+
+  lua_pushcfunction(RL, _task_decode);
+  lua_pushlightuserdata(RL, (void*)self);
+  if (lua_pcall(RL, 1, LUA_MULTRET, 0)) {
+    lua_pushboolean(RL, 0);
+    lua_insert(RL, -2);
+  }
+  nret = lua_gettop(RL) - base;
+  if (RL != L) lua_xmove(RL, L, nret);
+  return nret;
+}
+
+static void _pool_free(luv_pool_t* self);
+
+static void _pool_async_cb(uv_async_t* handle, int status) {
+  luv_pool_t* self = container_of(handle, luv_pool_t, async);
+  lua_State*  L = self->owner->L;
+  ngx_queue_t* q;
+  (void)status;
+
+  for (;;) {
+    luv_task_t* task;
+    uv_mutex_lock(&self->lock);
+    if (ngx_queue_empty(&self->done)) {
+      uv_mutex_unlock(&self->lock);
+      break;
+    }
+    q = ngx_queue_head(&self->done);
+    ngx_queue_remove(q);
+    uv_mutex_unlock(&self->lock);
+
+    task = ngx_queue_data(q, luv_task_t, queue);
+    task->flags |= LUV_FJOIN;
+
+    /* wake up joining states, fibers get the results on their stack */
+    while (!ngx_queue_empty(&task->rouse)) {
+      luv_state_t* s;
+      q = ngx_queue_head(&task->rouse);
+      s = ngx_queue_data(q, luv_state_t, join);
+      ngx_queue_remove(q);
+      if (s->type == LUV_TFIBER) {
+        lua_settop(s->L, 0);
+        _task_results(task, luvL_thread_current->L, s->L);
+      }
+      luvL_state_ready(s);
+    }
+
+    /* release the anchor taken in submit */
+    lua_pushlightuserdata(L, (void*)task);
+    lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    if (--self->active == 0 && !self->stop) {
+      uv_unref((uv_handle_t*)&self->async);
+    }
+  }
+
+  if (self->stop) {
+    int running;
+    uv_mutex_lock(&self->lock);
+    running = self->running;
+    uv_mutex_unlock(&self->lock);
+    if (!running) _pool_free(self);
+  }
+}
+
+static void _pool_close_cb(uv_handle_t* handle) {
+  luv_pool_t* self = container_of(handle, luv_pool_t, async);
+  free(self);
+}
+
+/* the workers run what is queued, then exit, the last one out has the
+** owner's loop free the pool */
+static void _pool_stop(luv_pool_t* self) {
+  uv_mutex_lock(&self->lock);
+  self->stop = 1;
+  uv_cond_broadcast(&self->cond);
+  uv_mutex_unlock(&self->lock);
+  /* keep the owner's loop running until then */
+  uv_ref((uv_handle_t*)&self->async);
+}
+
+/* called on the owner's loop once all workers have exited */
+static void _pool_free(luv_pool_t* self) {
+  int i;
+
+  for (i = 0; i < self->size; i++) {
+    uv_thread_join(&self->workers[i].thread.tid); /* already on its way out */
+  }
+
+  for (i = 0; i < self->size; i++) {
+    luv_worker_t* w = &self->workers[i];
+    lua_close(w->thread.L);
+    luvL_alloc_release(&w->thread.heap);
+    uv_loop_delete(w->thread.loop);
+    uv_mutex_destroy(&w->lock);
+  }
+  free(self->workers);
+
+  uv_cond_destroy(&self->cond);
+  uv_mutex_destroy(&self->lock);
+  luvL_cond_broadcast(&self->rouse);
+  uv_close((uv_handle_t*)&self->async, _pool_close_cb);
+}
+
+static luv_pool_t* _pool_check(lua_State* L, int idx) {
+  luv_pool_t* self = *(luv_pool_t**)luaL_checkudata(L, idx, LUV_POOL_T);
+  if (!self) {
+    luaL_error(L, "attempt to use a closed thread pool");
+  }
+  return self;
+}
+
+/* Lua API */
+static int luv_new_pool(lua_State* L) {
+  int size = luaL_optint(L, 1, 4);
+  luv_thread_t* owner = luvL_thread_self(L);
+  luv_pool_t* self;
+  int i;
+
+  luaL_argcheck(L, size > 0 && size <= 1024, 1, "invalid pool size");
+
+  self = (luv_pool_t*)malloc(sizeof(luv_pool_t));
+  self->workers = (luv_worker_t*)calloc(size, sizeof(luv_worker_t));
+
+  /* the states first, nothing else can fail */
+  for (i = 0; i < size; i++) {
+    luv_worker_t* w = &self->workers[i];
+    w->thread.L = luvL_newstate(&w->thread.heap);
+    if (!w->thread.L) {
+      while (i--) {
+        lua_close(self->workers[i].thread.L);
+        luvL_alloc_release(&self->workers[i].thread.heap);
+      }
+      free(self->workers);
+      free(self);
+      return luaL_error(L, "pool: cannot create a Lua state");
+    }
+  }
+
+  self->owner   = owner;
+  self->size    = size;
+  self->next    = 0;
+  self->pending = 0;
+  self->stop    = 0;
+  self->running = size;
+  self->active  = 0;
+  uv_mutex_init(&self->lock);
+  uv_cond_init(&self->cond);
+  ngx_queue_init(&self->done);
+  ngx_queue_init(&self->rouse);
+
+  uv_async_init(owner->loop, &self->async, _pool_async_cb);
+  uv_unref((uv_handle_t*)&self->async);
+
+  /* do all the setup thread.spawn does per thread once, up front */
+  for (i = 0; i < size; i++) {
+    luv_worker_t* w = &self->workers[i];
+    lua_State* WL = w->thread.L;
+
+    w->pool  = self;
+    w->index = i;
+    uv_mutex_init(&w->lock);
+    ngx_queue_init(&w->tasks);
+
+    luvL_thread_init(&w->thread, WL, uv_loop_new(), NULL);
+    luaL_openlibs(WL);
+    luaopen_luv(WL);
+    lua_settop(WL, 0);
+
+    /* keep a reference for reverse lookup in the worker */
+    lua_pushthread(WL);
+    lua_pushlightuserdata(WL, (void*)&w->thread);
+    lua_rawset(WL, LUA_REGISTRYINDEX);
+  }
+  for (i = 0; i < size; i++) {
+    luv_worker_t* w = &self->workers[i];
+    uv_thread_create(&w->thread.tid, _pool_enter, w);
+  }
+
+  luv_boxpointer(L, self);
+  luaL_getmetatable(L, LUV_POOL_T);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int luv_pool_submit(lua_State* L) {
+  luv_pool_t*   self = _pool_check(L, 1);
+  int           narg = lua_gettop(L) - 1;
+  luv_worker_t* w;
+  luv_task_t*   task;
+  const char*   data;
+  size_t        len;
+
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  if (luvL_thread_self(L) != self->owner) {
+    return luaL_error(L, "thread pool used outside of its thread");
+  }
+
+  luvL_codec_encode(L, narg);
+  data = lua_tolstring(L, -1, &len);
+
+  task = (luv_task_t*)lua_newuserdata(L, sizeof(luv_task_t));
+  luaL_getmetatable(L, LUV_TASK_T);
+  lua_setmetatable(L, -2);
+
+  task->flags = 0;
+  task->len   = len;
+  task->data  = (char*)malloc(len);
+  memcpy(task->data, data, len);
+  ngx_queue_init(&task->rouse);
+
+  /* keep it alive until the results are delivered */
+  lua_pushlightuserdata(L, (void*)task);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+
+  if (self->active++ == 0) {
+    uv_ref((uv_handle_t*)&self->async);
+  }
+
+  w = &self->workers[self->next];
+  if (++self->next == self->size) self->next = 0;
+
+  uv_mutex_lock(&w->lock);
+  ngx_queue_insert_tail(&w->tasks, &task->queue);
+  uv_mutex_unlock(&w->lock);
+
+  uv_mutex_lock(&self->lock);
+  self->pending++;
+  uv_cond_signal(&self->cond);
+  uv_mutex_unlock(&self->lock);
+
+  return 1;
+}
+
+static int luv_pool_size(lua_State* L) {
+  luv_pool_t* self = _pool_check(L, 1);
+  lua_pushinteger(L, self->size);
+  lua_pushinteger(L, self->active);
+  return 2;
+}
+
+static int luv_pool_close(lua_State* L) {
+  luv_pool_t** box = (luv_pool_t**)luaL_checkudata(L, 1, LUV_POOL_T);
+  luv_pool_t*  self = *box;
+  if (!self) return 0;
+  *box = NULL;
+  _pool_stop(self);
+  lua_settop(L, 0);
+  return luvL_cond_wait(&self->rouse, luvL_state_self(L));
+}
+
+static int luv_pool_free(lua_State* L) {
+  luv_pool_t** box = (luv_pool_t**)lua_touserdata(L, 1);
+  /* can't wait in a finalizer, the owner's loop finishes the job */
+  if (*box) {
+    _pool_stop(*box);
+    *box = NULL;
+  }
+  return 0;
+}
+
+static int luv_pool_tostring(lua_State* L) {
+  luv_pool_t** box = (luv_pool_t**)luaL_checkudata(L, 1, LUV_POOL_T);
+  lua_pushfstring(L, "userdata<%s>: %p", LUV_POOL_T, *box);
+  return 1;
+}
+
+static int luv_task_join(lua_State* L) {
+  luv_task_t*  self = (luv_task_t*)luaL_checkudata(L, 1, LUV_TASK_T);
+  luv_state_t* curr = luvL_state_self(L);
+
+  if (!(self->flags & LUV_FJOIN)) {
+    ngx_queue_insert_tail(&self->rouse, &curr->join);
+    if (curr->type == LUV_TFIBER) {
+      /* _pool_async_cb leaves the results on our stack */
+      return luvL_state_suspend(curr);
+    }
+    while (!(self->flags & LUV_FJOIN)) {
+      luvL_state_suspend(curr);
+    }
+  }
+
+  lua_settop(L, 0);
+  return _task_results(self, L, L);
+}
+
+static int luv_task_done(lua_State* L) {
+  luv_task_t* self = (luv_task_t*)luaL_checkudata(L, 1, LUV_TASK_T);
+  lua_pushboolean(L, self->flags & LUV_FJOIN);
+  return 1;
+}
+
+static int luv_task_free(lua_State* L) {
+  luv_task_t* self = (luv_task_t*)lua_touserdata(L, 1);
+  /* only undelivered when the whole state is closing, leave it to
+  ** the worker */
+  if (self->flags & LUV_FJOIN) free(self->data);
+  return 0;
+}
+
+static int luv_task_tostring(lua_State* L) {
+  luv_task_t* self = (luv_task_t*)luaL_checkudata(L, 1, LUV_TASK_T);
+  lua_pushfstring(L, "userdata<%s>: %p", LUV_TASK_T, self);
+  return 1;
+}
+
+luaL_Reg luv_pool_funcs[] = {
+  {"pool",      luv_new_pool},
+  {NULL,        NULL}
+};
+
+luaL_Reg luv_pool_meths[] = {
+  {"submit",    luv_pool_submit},
+  {"size",      luv_pool_size},
+  {"close",     luv_pool_close},
+  {"__gc",      luv_pool_free},
+  {"__tostring",luv_pool_tostring},
+  {NULL,        NULL}
+};
+
+luaL_Reg luv_task_meths[] = {
+  {"join",      luv_task_join},
+  {"done",      luv_task_done},
+  {"__gc",      luv_task_free},
+  {"__tostring",luv_task_tostring},
+  {NULL,        NULL}
+};
@@ -0,0 +1,205 @@
+#include "luv.h"
+#include <stdio.h>
+#include <errno.h>
+
+/* Sampling profiler. A helper OS thread wakes up `hz' times a second and
+** raises a flag. The profiled thread runs its states with the count hook
+** of luv_loop.c, set by the thread itself before each resume, and the
+** first hook to see the flag records the Lua stack of its state as a
+** folded stack line
+** (root first, frames separated by `;') in a table of counts. If the flag
+** is still up on the next tick, the thread was polling or blocked outside
+** Lua and the tick is counted as `[idle]'. */
+
+#define LUV_PROFILER_KEY "luv:profiler"
+
+typedef struct luv_profiler_s {
+  luv_thread_t*   thread;
+  uv_thread_t     tid;
+  uv_mutex_t      lock;
+  uv_cond_t       cond;
+  uint64_t        interval; /* ns between samples */
+  int             stop;
+  volatile int    tick;     /* raised by the sampler, taken by a hook */
+  unsigned long   idle;
+} luv_profiler_t;
+
+static LUV_THREAD_LOCAL luv_profiler_t* luv_profiler_current = NULL;
+
+int luvL_profiler_active(void) {
+  return luv_profiler_current != NULL;
+}
+
+/* take a sample of L if one is due, from the hook */
+void luvL_profiler_sample(lua_State* L) {
+  luv_profiler_t* self = luv_profiler_current;
+  luv_state_t* state;
+  luaL_Buffer b;
+  lua_Debug frame;
+  int depth, level;
+
+  if (!self || !self->tick) return;
+  self->tick = 0;
+
+  /* counts table first so the buffer stays on top */
+  lua_getfield(L, LUA_REGISTRYINDEX, LUV_PROFILER_KEY);
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    return;
+  }
+
+  state = luvL_state_self(L);
+  luaL_buffinit(L, &b);
+  if (state && state->type == LUV_TFIBER) {
+    lua_pushfstring(L, "fiber:%p", state);
+  }
+  else {
+    lua_pushfstring(L, "thread:%p", state);
+  }
+  luaL_addvalue(&b);
+
+  for (depth = 0; lua_getstack(L, depth, &frame); depth++);
+  for (level = depth - 1; level >= 0; level--) {
+    lua_getstack(L, level, &frame);
+    lua_getinfo(L, "Sn", &frame);
+    if (*frame.what == 'C') {
+      lua_pushfstring(L, ";%s [C]", frame.name ? frame.name : "?");
+    }
+    else {
+      lua_pushfstring(L, ";%s (%s:%d)",
+        frame.name ? frame.name : (*frame.what == 'm' ? "main" : "?"),
+        frame.short_src, frame.linedefined
+      );
+    }
+    luaL_addvalue(&b);
+  }
+  luaL_pushresult(&b);
+
+  lua_pushvalue(L, -1);
+  lua_rawget(L, -3);
+  lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+  lua_replace(L, -2);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+static void _prof_sampler(void* arg) {
+  luv_profiler_t* self = (luv_profiler_t*)arg;
+  uv_mutex_lock(&self->lock);
+  while (!self->stop) {
+    if (uv_cond_timedwait(&self->cond, &self->lock, self->interval) == 0) {
+      continue; /* signalled */
+    }
+    /* only the profiled thread touches its states */
+    if (self->tick) {
+      /* not back in Lua since the last tick */
+      self->idle++;
+    }
+    else {
+      self->tick = 1;
+    }
+  }
+  uv_mutex_unlock(&self->lock);
+}
+
+/* Lua API */
+static int luv_profiler_start(lua_State* L) {
+  lua_Number hz = luaL_optnumber(L, 1, 1000);
+  luv_profiler_t* self;
+
+  if (luv_profiler_current) {
+    return luaL_error(L, "profiler already running in this thread");
+  }
+  luaL_argcheck(L, hz > 0 && hz <= 100000, 1, "invalid sampling rate");
+
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUV_PROFILER_KEY);
+
+  self = (luv_profiler_t*)malloc(sizeof(luv_profiler_t));
+  self->thread   = luvL_thread_self(L);
+  self->interval = (uint64_t)(1e9 / hz);
+  self->stop     = 0;
+  self->tick     = 0;
+  self->idle     = 0;
+  uv_mutex_init(&self->lock);
+  uv_cond_init(&self->cond);
+
+  luv_profiler_current = self;
+  if (uv_thread_create(&self->tid, _prof_sampler, self)) {
+    luv_profiler_current = NULL;
+    uv_cond_destroy(&self->cond);
+    uv_mutex_destroy(&self->lock);
+    free(self);
+    return luaL_error(L, "failed to start the sampler thread");
+  }
+  luvL_hook_arm(L);
+  luvL_hook_arm(self->thread->L);
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int luv_profiler_stop(lua_State* L) {
+  luv_profiler_t* self = luv_profiler_current;
+
+  if (!self) {
+    return luaL_error(L, "profiler not running in this thread");
+  }
+
+  uv_mutex_lock(&self->lock);
+  self->stop = 1;
+  uv_cond_signal(&self->cond);
+  uv_mutex_unlock(&self->lock);
+  uv_thread_join(&self->tid);
+
+  /* hooks left on suspended fibers remove themselves when they fire */
+  luv_profiler_current = NULL;
+  luvL_hook_arm(L);
+  luvL_hook_arm(self->thread->L);
+
+  /* fold the counts into lines of `stack count' */
+  lua_settop(L, 1);
+  lua_getfield(L, LUA_REGISTRYINDEX, LUV_PROFILER_KEY);
+  lua_pushliteral(L, "");
+  lua_pushnil(L);
+  while (lua_next(L, 2)) {
+    lua_pushfstring(L, "%s %d\n", lua_tostring(L, -2), (int)lua_tointeger(L, -1));
+    lua_replace(L, -2);                  /* [tbl, out, key, line] */
+    lua_pushvalue(L, 3);
+    lua_insert(L, -2);
+    lua_concat(L, 2);
+    lua_replace(L, 3);                   /* [tbl, out, key] */
+  }
+  if (self->idle) {
+    lua_pushfstring(L, "thread:%p;[idle] %d\n", self->thread, (int)self->idle);
+    lua_concat(L, 2);
+  }
+  lua_pushnil(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUV_PROFILER_KEY);
+
+  uv_cond_destroy(&self->cond);
+  uv_mutex_destroy(&self->lock);
+  free(self);
+
+  if (!lua_isnoneornil(L, 1)) {
+    size_t len;
+    const char* path = luaL_checkstring(L, 1);
+    const char* data = lua_tolstring(L, -1, &len);
+    FILE* fh = fopen(path, "w");
+    if (!fh) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: %s", path, strerror(errno));
+      return 2;
+    }
+    fwrite(data, 1, len, fh);
+    fclose(fh);
+    lua_pushboolean(L, 1);
+  }
+  return 1;
+}
+
+luaL_Reg luv_profiler_funcs[] = {
+  {"start",     luv_profiler_start},
+  {"stop",      luv_profiler_stop},
+  {NULL,        NULL}
+};
@@ -0,0 +1,608 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "luv.h"
+
+/* Snapshots: luv.codec.dump_file writes a value in a layout which is read
+** in place from a mapping of the file, so loading it never holds the
+** whole file in a Lua string. Each value is a 16 byte slot, a table is
+** a block of slots, and both refer to strings and tables by their file
+** offset. Slots and blocks are 8 byte aligned and numbers are native, so
+** a snapshot is only read by a machine of the kind which wrote it. */
+
+#define LUV_SNAP_MAGIC   "LUVS"
+#define LUV_SNAP_VERSION 1 /* byte swapped on the wrong kind of machine */
+#define LUV_SNAP_DEPTH   200
+
+typedef struct luv_snap_slot_s {
+  uint32_t  type; /* LUA_T* */
+  uint32_t  len;  /* of a string */
+  uint64_t  val;  /* boolean, number bits, or offset of a string or table */
+} luv_snap_slot_t;
+
+typedef struct luv_snap_head_s {
+  char            magic[4];
+  uint32_t        version;
+  luv_snap_slot_t root;
+} luv_snap_head_t;
+
+/* a table block is followed by narr slots for the array part, then by
+** nrec key and value slot pairs */
+typedef struct luv_snap_table_s {
+  uint32_t  narr;
+  uint32_t  nrec;
+} luv_snap_table_t;
+
+typedef struct luv_snap_writer_s {
+  uint8_t*  base;
+  size_t    size;
+  size_t    len;
+  int       seen; /* string or table -> offset */
+  int       depth;
+} luv_snap_writer_t;
+
+typedef struct luv_snap_map_s {
+  const uint8_t*  base;
+  size_t          size;
+#ifdef _WIN32
+  HANDLE          file;
+  HANDLE          mapping;
+#endif
+} luv_snap_map_t;
+
+typedef struct luv_snap_reader_s {
+  const uint8_t*  base;
+  size_t          size;
+  int             seen;     /* offset -> table */
+  int             offsets;  /* unread table -> offset, lazy only */
+  int             meta;     /* metatable of unread tables, lazy only */
+  int             depth;
+} luv_snap_reader_t;
+
+/* room for `len' bytes at the end, returns their offset */
+static size_t snap_reserve(lua_State* L, luv_snap_writer_t* w, size_t len, size_t align) {
+  size_t off = (w->len + align - 1) & ~(align - 1);
+  if (off + len > w->size) {
+    size_t size = w->size ? w->size : 4096;
+    uint8_t* base;
+    while (size < off + len) size *= 2;
+    base = (uint8_t*)realloc(w->base, size);
+    if (!base) luaL_error(L, "dump_file: out of memory");
+    w->base = base;
+    w->size = size;
+  }
+  memset(w->base + w->len, 0, off + len - w->len);
+  w->len = off + len;
+  return off;
+}
+
+/* the offset the value at -1 was written at, if it was */
+static int snap_seen(lua_State* L, luv_snap_writer_t* w, uint64_t* off) {
+  lua_pushvalue(L, -1);
+  lua_rawget(L, w->seen);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  *off = (uint64_t)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  return 1;
+}
+static void snap_mark(lua_State* L, luv_snap_writer_t* w, uint64_t off) {
+  lua_pushvalue(L, -1);
+  lua_pushnumber(L, (lua_Number)off);
+  lua_rawset(L, w->seen);
+}
+
+static int snap_in_array(lua_State* L, int idx, uint32_t narr) {
+  lua_Number k;
+  if (lua_type(L, idx) != LUA_TNUMBER) return 0;
+  k = lua_tonumber(L, idx);
+  return k >= 1 && k <= narr && k == (lua_Number)(uint32_t)k;
+}
+
+static uint64_t snap_write_table(lua_State* L, luv_snap_writer_t* w);
+
+/* write the slot for the value at -1 at offset `at' */
+static void snap_write_value(lua_State* L, luv_snap_writer_t* w, size_t at) {
+  luv_snap_slot_t slot;
+  int type = lua_type(L, -1);
+  slot.type = (uint32_t)type;
+  slot.len  = 0;
+  slot.val  = 0;
+
+  switch (type) {
+  case LUA_TNIL:
+    break;
+  case LUA_TBOOLEAN:
+    slot.val = (uint64_t)lua_toboolean(L, -1);
+    break;
+  case LUA_TNUMBER: {
+    double v = (double)lua_tonumber(L, -1);
+    memcpy(&slot.val, &v, sizeof v);
+    break;
+  }
+  case LUA_TSTRING: {
+    size_t len;
+    const char* str = lua_tolstring(L, -1, &len);
+    if (len > 0xffffffffU) luaL_error(L, "dump_file: string too long");
+    slot.len = (uint32_t)len;
+    if (!snap_seen(L, w, &slot.val)) {
+      slot.val = snap_reserve(L, w, len, 1);
+      memcpy(w->base + slot.val, str, len);
+      snap_mark(L, w, slot.val);
+    }
+    break;
+  }
+  case LUA_TTABLE:
+    slot.val = snap_write_table(L, w);
+    break;
+  default:
+    luaL_error(L, "dump_file: cannot dump a `%s'", lua_typename(L, type));
+  }
+  memcpy(w->base + at, &slot, sizeof slot);
+}
+
+static uint64_t snap_write_table(lua_State* L, luv_snap_writer_t* w) {
+  luv_snap_table_t head;
+  uint64_t off;
+  uint32_t i, narr, nrec = 0;
+  size_t at;
+
+  if (snap_seen(L, w, &off)) return off;
+  luvL_codec_materialize(L, -1);
+  if (++w->depth > LUV_SNAP_DEPTH) {
+    luaL_error(L, "dump_file: tables nested too deeply");
+  }
+  luaL_checkstack(L, 4, "dump_file: tables nested too deeply");
+
+  narr = (uint32_t)lua_rawlen(L, -1);
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0) {
+    lua_pop(L, 1);
+    if (!snap_in_array(L, -1, narr)) nrec++;
+  }
+
+  /* marked before the contents are written, so cycles refer back */
+  off = snap_reserve(L, w, sizeof head +
+    ((size_t)narr + 2 * (size_t)nrec) * sizeof(luv_snap_slot_t), 8);
+  snap_mark(L, w, off);
+  head.narr = narr;
+  head.nrec = nrec;
+  memcpy(w->base + off, &head, sizeof head);
+
+  at = (size_t)off + sizeof head;
+  for (i = 1; i <= narr; i++) {
+    lua_rawgeti(L, -1, i);
+    snap_write_value(L, w, at);
+    lua_pop(L, 1);
+    at += sizeof(luv_snap_slot_t);
+  }
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0) {
+    if (!snap_in_array(L, -2, narr)) {
+      lua_pushvalue(L, -2);
+      snap_write_value(L, w, at);
+      lua_pop(L, 1);
+      snap_write_value(L, w, at + sizeof(luv_snap_slot_t));
+      at += 2 * sizeof(luv_snap_slot_t);
+    }
+    lua_pop(L, 1);
+  }
+  w->depth--;
+  return off;
+}
+
+/* protected part of dump_file, the writer and the value are args */
+static int snap_dump(lua_State* L) {
+  luv_snap_writer_t* w = (luv_snap_writer_t*)lua_touserdata(L, 1);
+  luv_snap_head_t head;
+  lua_newtable(L);
+  w->seen = lua_gettop(L);
+  lua_pushvalue(L, 2);
+
+  snap_reserve(L, w, sizeof head, 8);
+  snap_write_value(L, w, offsetof(luv_snap_head_t, root));
+  memcpy(head.magic, LUV_SNAP_MAGIC, 4);
+  head.version = LUV_SNAP_VERSION;
+  memcpy(w->base, &head, offsetof(luv_snap_head_t, root));
+  return 0;
+}
+
+/* luv.codec.dump_file(path, value), writes to a new file which then
+** replaces `path', so those who have the old one mapped keep it whole */
+int luvL_codec_dump_file(lua_State* L) {
+  const char* path = luaL_checkstring(L, 1);
+  luv_snap_writer_t w;
+  FILE* fh;
+  int rv, ok;
+
+  luaL_checkany(L, 2);
+  memset(&w, 0, sizeof w);
+  lua_pushcfunction(L, snap_dump);
+  lua_pushlightuserdata(L, &w);
+  lua_pushvalue(L, 2);
+  if (lua_pcall(L, 2, 0, 0)) {
+    free(w.base);
+    return lua_error(L);
+  }
+
+  lua_pushfstring(L, "%s.tmp", path);
+  fh = fopen(lua_tostring(L, -1), "wb");
+  ok = fh && fwrite(w.base, 1, w.len, fh) == w.len;
+  if (fh && fclose(fh)) ok = 0;
+  free(w.base);
+  if (ok) {
+#ifdef _WIN32
+    remove(path);
+#endif
+    ok = !rename(lua_tostring(L, -1), path);
+  }
+  if (!ok) {
+    rv = errno;
+    remove(lua_tostring(L, -1));
+    return luaL_error(L, "dump_file: %s: %s", path, strerror(rv));
+  }
+  lua_pushinteger(L, (lua_Integer)w.len);
+  return 1;
+}
+
+static void snap_unmap(luv_snap_map_t* m) {
+  if (!m->base) return;
+#ifdef _WIN32
+  UnmapViewOfFile((LPCVOID)m->base);
+  CloseHandle(m->mapping);
+  CloseHandle(m->file);
+#else
+  munmap((void*)m->base, m->size);
+#endif
+  m->base = NULL;
+}
+
+/* push a userdata holding the mapping of `path', unmapped when collected */
+static luv_snap_map_t* snap_map(lua_State* L, const char* path) {
+  luv_snap_map_t* m = (luv_snap_map_t*)lua_newuserdata(L, sizeof(luv_snap_map_t));
+  memset(m, 0, sizeof(luv_snap_map_t));
+  luaL_getmetatable(L, LUV_CODEC_SNAP_T);
+  lua_setmetatable(L, -2);
+#ifdef _WIN32
+  {
+    LARGE_INTEGER size;
+    HANDLE file, mapping;
+    void* base;
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+      if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+      luaL_error(L, "load_file: %s: cannot open", path);
+    }
+    if (size.QuadPart < (LONGLONG)sizeof(luv_snap_head_t)) {
+      CloseHandle(file);
+      luaL_error(L, "load_file: %s: not a snapshot", path);
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    base = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!base) {
+      if (mapping) CloseHandle(mapping);
+      CloseHandle(file);
+      luaL_error(L, "load_file: %s: cannot map", path);
+    }
+    m->file    = file;
+    m->mapping = mapping;
+    m->size    = (size_t)size.QuadPart;
+    m->base    = (const uint8_t*)base;
+  }
+#else
+  {
+    struct stat st;
+    void* base;
+    int err, fd = open(path, O_RDONLY);
+    if (fd < 0) luaL_error(L, "load_file: %s: %s", path, strerror(errno));
+    if (fstat(fd, &st)) {
+      err = errno;
+      close(fd);
+      luaL_error(L, "load_file: %s: %s", path, strerror(err));
+    }
+    if (st.st_size < (off_t)sizeof(luv_snap_head_t)) {
+      close(fd);
+      luaL_error(L, "load_file: %s: not a snapshot", path);
+    }
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = errno;
+    close(fd);
+    if (base == MAP_FAILED) luaL_error(L, "load_file: %s: %s", path, strerror(err));
+    m->size = (size_t)st.st_size;
+    m->base = (const uint8_t*)base;
+  }
+#endif
+  return m;
+}
+
+static void snap_bad(lua_State* L) {
+  luaL_error(L, "load_file: corrupt snapshot");
+}
+
+static void snap_read_table(lua_State* L, luv_snap_reader_t* r, uint64_t off);
+
+/* push the value of the slot at offset `at', which is in bounds */
+static void snap_read_value(lua_State* L, luv_snap_reader_t* r, size_t at) {
+  luv_snap_slot_t slot;
+  memcpy(&slot, r->base + at, sizeof slot);
+
+  switch (slot.type) {
+  case LUA_TNIL:
+    lua_pushnil(L);
+    break;
+  case LUA_TBOOLEAN:
+    lua_pushboolean(L, slot.val != 0);
+    break;
+  case LUA_TNUMBER: {
+    double v;
+    memcpy(&v, &slot.val, sizeof v);
+    lua_pushnumber(L, (lua_Number)v);
+    break;
+  }
+  case LUA_TSTRING:
+    if (slot.val > r->size || slot.len > r->size - slot.val) snap_bad(L);
+    lua_pushlstring(L, (const char*)r->base + slot.val, slot.len);
+    break;
+  case LUA_TTABLE:
+    snap_read_table(L, r, slot.val);
+    break;
+  default:
+    snap_bad(L);
+  }
+}
+
+/* the head of the table block at `off', checking it is all in the file */
+static void snap_table_head(lua_State* L, luv_snap_reader_t* r, uint64_t off,
+                            luv_snap_table_t* head) {
+  uint64_t nslot;
+  if ((off & 7) || off < sizeof(luv_snap_head_t) ||
+      off > r->size - sizeof(luv_snap_table_t)) {
+    snap_bad(L);
+  }
+  memcpy(head, r->base + off, sizeof(luv_snap_table_t));
+  nslot = (uint64_t)head->narr + 2 * (uint64_t)head->nrec;
+  if (nslot > (r->size - off - sizeof(luv_snap_table_t)) / sizeof(luv_snap_slot_t)) {
+    snap_bad(L);
+  }
+}
+
+/* fill the table at -1 from the block at `off' */
+static void snap_fill(lua_State* L, luv_snap_reader_t* r, uint64_t off) {
+  luv_snap_table_t head;
+  uint32_t i;
+  size_t at;
+
+  if (++r->depth > LUV_SNAP_DEPTH) snap_bad(L);
+  luaL_checkstack(L, 4, "load_file: tables nested too deeply");
+  snap_table_head(L, r, off, &head);
+
+  at = (size_t)off + sizeof head;
+  for (i = 1; i <= head.narr; i++) {
+    snap_read_value(L, r, at);
+    lua_rawseti(L, -2, i);
+    at += sizeof(luv_snap_slot_t);
+  }
+  for (i = 0; i < head.nrec; i++) {
+    snap_read_value(L, r, at);
+    if (lua_isnil(L, -1)) snap_bad(L);
+    snap_read_value(L, r, at + sizeof(luv_snap_slot_t));
+    lua_rawset(L, -3);
+    at += 2 * sizeof(luv_snap_slot_t);
+  }
+  r->depth--;
+}
+
+/* eagerly the filled table, lazily an empty one standing in for it */
+static void snap_read_table(lua_State* L, luv_snap_reader_t* r, uint64_t off) {
+  luv_snap_table_t head;
+  lua_pushnumber(L, (lua_Number)off);
+  lua_rawget(L, r->seen);
+  if (!lua_isnil(L, -1)) return;
+  lua_pop(L, 1);
+
+  snap_table_head(L, r, off, &head);
+  if (r->meta) {
+    lua_newtable(L);
+    lua_pushvalue(L, r->meta);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_pushnumber(L, (lua_Number)off);
+    lua_rawset(L, r->offsets);
+  }
+  else {
+    lua_createtable(L, (int)head.narr, (int)head.nrec);
+  }
+  lua_pushnumber(L, (lua_Number)off);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, r->seen);
+
+  if (!r->meta) snap_fill(L, r, off);
+}
+
+/* Lazy tables: the metamethods share the upvalues mapping, seen and
+** offsets. The first access fills the table from its block and drops
+** its metatable, so it is a plain table from then on */
+static void snap_fill_lazy(lua_State* L, int idx, int map, int seen, int offsets) {
+  luv_snap_map_t* m = (luv_snap_map_t*)lua_touserdata(L, map);
+  luv_snap_reader_t r;
+  uint64_t off;
+
+  lua_pushvalue(L, idx);
+  lua_rawget(L, offsets);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return;
+  }
+  off = (uint64_t)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  r.base    = m->base;
+  r.size    = m->size;
+  r.seen    = seen;
+  r.offsets = offsets;
+  r.depth   = 0;
+  lua_getmetatable(L, idx);
+  r.meta    = lua_gettop(L);
+
+  lua_pushvalue(L, idx);
+  snap_fill(L, &r, off);
+  lua_pop(L, 2);
+
+  lua_pushvalue(L, idx);
+  lua_pushnil(L);
+  lua_rawset(L, offsets);
+  lua_pushnil(L);
+  lua_setmetatable(L, idx);
+}
+
+static void snap_materialize(lua_State* L, int idx) {
+  snap_fill_lazy(L, idx, lua_upvalueindex(1), lua_upvalueindex(2),
+    lua_upvalueindex(3));
+}
+
+static int snap_index(lua_State* L);
+
+/* fill the table at idx if it is still an unread lazy table, for the
+** encoders which walk tables with lua_next */
+void luvL_codec_materialize(lua_State* L, int idx) {
+  int top = lua_gettop(L);
+  if (idx < 0) idx = top + idx + 1;
+  luaL_checkstack(L, 8, "codec: tables nested too deeply");
+  if (!lua_getmetatable(L, idx)) return;
+  lua_getfield(L, -1, "__index");
+  if (lua_tocfunction(L, -1) == snap_index) {
+    lua_getupvalue(L, -1, 1);
+    lua_getupvalue(L, -2, 2);
+    lua_getupvalue(L, -3, 3);
+    snap_fill_lazy(L, idx, top + 3, top + 4, top + 5);
+  }
+  lua_settop(L, top);
+}
+
+static int snap_index(lua_State* L) {
+  snap_materialize(L, 1);
+  lua_settop(L, 2);
+  lua_rawget(L, 1);
+  return 1;
+}
+static int snap_newindex(lua_State* L) {
+  snap_materialize(L, 1);
+  lua_settop(L, 3);
+  lua_rawset(L, 1);
+  return 0;
+}
+static int snap_len(lua_State* L) {
+  snap_materialize(L, 1);
+  lua_pushinteger(L, (lua_Integer)lua_rawlen(L, 1));
+  return 1;
+}
+static int snap_next(lua_State* L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 2);
+  if (lua_next(L, 1)) return 2;
+  lua_pushnil(L);
+  return 1;
+}
+static int snap_pairs(lua_State* L) {
+  snap_materialize(L, 1);
+  lua_pushcfunction(L, snap_next);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+static int snap_inext(lua_State* L) {
+  lua_Integer i = luaL_checkinteger(L, 2) + 1;
+  lua_pushinteger(L, i);
+  lua_rawgeti(L, 1, (int)i);
+  return lua_isnil(L, -1) ? 1 : 2;
+}
+static int snap_ipairs(lua_State* L) {
+  snap_materialize(L, 1);
+  lua_pushcfunction(L, snap_inext);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+static luaL_Reg luv_snap_lazy_meths[] = {
+  {"__index",     snap_index},
+  {"__newindex",  snap_newindex},
+  {"__len",       snap_len},
+  {"__pairs",     snap_pairs},
+  {"__ipairs",    snap_ipairs},
+  {NULL,          NULL}
+};
+
+/* luv.codec.load_file(path[, lazy]) */
+int luvL_codec_load_file(lua_State* L) {
+  const char* path = luaL_checkstring(L, 1);
+  int lazy = lua_toboolean(L, 2);
+  luv_snap_reader_t r;
+  luv_snap_head_t head;
+  luv_snap_map_t* m;
+
+  lua_settop(L, 1);
+  m = snap_map(L, path);                /* 2 */
+  memcpy(&head, m->base, sizeof head);
+  if (memcmp(head.magic, LUV_SNAP_MAGIC, 4) || head.version != LUV_SNAP_VERSION) {
+    snap_unmap(m);
+    return luaL_error(L, "load_file: %s: not a snapshot from this kind of machine", path);
+  }
+
+  r.base    = m->base;
+  r.size    = m->size;
+  r.depth   = 0;
+  r.offsets = 0;
+  r.meta    = 0;
+  lua_newtable(L);                      /* 3, seen */
+  r.seen = 3;
+
+  if (lazy) {
+    /* weak, so what is no longer used can be collected */
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, 3);
+
+    lua_newtable(L);                    /* 4, offsets */
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, 4);
+    r.offsets = 4;
+
+    lua_newtable(L);                    /* 5, metatable of unread tables */
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_pushvalue(L, 4);
+    luaL_setfuncs(L, luv_snap_lazy_meths, 3);
+    r.meta = 5;
+  }
+
+  snap_read_value(L, &r, offsetof(luv_snap_head_t, root));
+  if (!lazy) snap_unmap(m);
+  return 1;
+}
+
+static int luv_snap_map_free(lua_State* L) {
+  snap_unmap((luv_snap_map_t*)lua_touserdata(L, 1));
+  return 0;
+}
+
+luaL_Reg luv_codec_snap_meths[] = {
+  {"__gc",        luv_snap_map_free},
+  {NULL,          NULL}
+};
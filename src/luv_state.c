@@ -9,6 +9,11 @@ int luvL_state_in_thread(luv_state_t* state) {
 
 luv_state_t* luvL_state_self(lua_State* L) {
   luv_state_t* self ;
+  luv_thread_t* thread = luvL_thread_current;
+  /* fast path: L is the running state of this OS thread */
+  if (thread && thread->curr->L == L) {
+    return thread->curr;
+  }
   lua_pushthread(L);
   lua_rawget(L, LUA_REGISTRYINDEX);
   self = (luv_state_t*)lua_touserdata(L, -1);
@@ -17,7 +22,14 @@ luv_state_t* luvL_state_self(lua_State* L) {
 }
 
 int luvL_state_is_active(luv_state_t* state) {
-  return state == luvL_thread_self(state->L)->curr;
+  luv_thread_t* thread;
+  if (state->type == LUV_TTHREAD) {
+    thread = (luv_thread_t*)state;
+  }
+  else {
+    thread = (luv_thread_t*)state->outer;
+  }
+  return state == thread->curr;
 }
 
 /* resume at the next iteration of the loop */
@@ -1,10 +1,33 @@
 #include "luv.h"
+#include <errno.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+/* Framed messages for send and recv: a uleb128 length followed by a
+** codec message. Once a stream is used with recv its reads are gathered
+** in a luv_frame_t in `data', and a waiting state is only woken when a
+** whole message is there. */
+#define LUV_FRAME_MAX (16 * 1024 * 1024)
+
+typedef struct luv_frame_s {
+  char*     base;
+  size_t    head;   /* start of the data not consumed yet */
+  size_t    len;    /* end of the data */
+  size_t    size;
+  int       eof;    /* 1 at the end of the stream, -1 on an error */
+  uv_err_t  err;
+} luv_frame_t;
+
+static void _frame_read_cb(luv_object_t* self, ssize_t len, uv_buf_t buf);
 
 /* used by udp and stream */
 uv_buf_t luvL_alloc_cb(uv_handle_t* handle, size_t size) {
   luv_object_t* self = container_of(handle, luv_object_t, h);
   size = (size_t)self->buf.len;
-  return uv_buf_init((char*)malloc(size), size);
+  return uv_buf_init((char*)luvL_alloc(size), size);
 }
 
 /* used by tcp and pipe */
@@ -17,6 +40,11 @@ static void _read_cb(uv_stream_t* stream, ssize_t len, uv_buf_t buf) {
   luv_object_t* self  = container_of(stream, luv_object_t, h);
   TRACE("got data\n");
 
+  if (self->flags & LUV_OFRAMED) {
+    _frame_read_cb(self, len, buf);
+    return;
+  }
+
   if (ngx_queue_empty(&self->rouse)) {
     TRACE("empty read queue, save buffer and stop read\n");
     luvL_stream_stop(self);
@@ -26,7 +54,7 @@ static void _read_cb(uv_stream_t* stream, ssize_t len, uv_buf_t buf) {
     }
     else {
       if (buf.base) {
-        free(buf.base);
+        luvL_free(buf.base);
         buf.base = NULL;
         buf.len  = 0;
       }
@@ -66,7 +94,7 @@ static void _read_cb(uv_stream_t* stream, ssize_t len, uv_buf_t buf) {
       }
     }
     if (buf.base) {
-      free(buf.base);
+      luvL_free(buf.base);
       buf.len  = 0;
       buf.base = NULL;
     }
@@ -75,6 +103,92 @@ static void _read_cb(uv_stream_t* stream, ssize_t len, uv_buf_t buf) {
   }
 }
 
+/* bytes which came with a handle nobody was accepting yet, queued in
+** `passed' in the order of the handles */
+typedef struct luv_passed_s {
+  struct luv_passed_s* next;
+  size_t len;
+  char   data[1];
+} luv_passed_t;
+
+static void _passed_push(luv_object_t* self, const char* data, size_t len) {
+  luv_passed_t** p = (luv_passed_t**)&self->passed;
+  luv_passed_t*  e = (luv_passed_t*)malloc(sizeof(luv_passed_t) + len);
+  e->next = NULL;
+  e->len  = len;
+  memcpy(e->data, data, len);
+  while (*p) p = &(*p)->next;
+  *p = e;
+}
+static luv_passed_t* _passed_pop(luv_object_t* self) {
+  luv_passed_t* e = (luv_passed_t*)self->passed;
+  if (e) self->passed = e->next;
+  return e;
+}
+static void _passed_free(luv_object_t* self) {
+  luv_passed_t* e;
+  while ((e = _passed_pop(self))) free(e);
+}
+
+/* the tcp or pipe at idx, or NULL */
+static luv_object_t* _stream_test(lua_State* L, int idx) {
+  void* self = luaL_testudata(L, idx, LUV_NET_TCP_T);
+  if (!self) self = luaL_testudata(L, idx, LUV_PIPE_T);
+  return (luv_object_t*)self;
+}
+
+/* the first state waiting in accept, readers wait on the same queue */
+static luv_state_t* _accept_waiter(luv_object_t* self) {
+  ngx_queue_t* q;
+  ngx_queue_foreach(q, &self->rouse) {
+    luv_state_t* s = ngx_queue_data(q, luv_state_t, cond);
+    if (_stream_test(s->L, 2)) return s;
+  }
+  return NULL;
+}
+
+/* IPC pipes read with read2 so handles sent with write2 can be accepted,
+** a handle and the bytes sent with it are taken by a state waiting in
+** accept, if there is none the pipe keeps them for the next accept, and
+** stops reading unless a reader is waiting */
+static void _read2_cb(uv_pipe_t* pipe, ssize_t len, uv_buf_t buf, uv_handle_type pending) {
+  luv_object_t* self = container_of(pipe, luv_object_t, h);
+  luv_state_t* s = NULL;
+
+  if (pending == UV_UNKNOWN_HANDLE) {
+    _read_cb((uv_stream_t*)pipe, len, buf);
+    return;
+  }
+
+  if (len < 0) len = 0;
+  if (luvL_object_is_waiting(self)) s = _accept_waiter(self);
+  if (s) {
+    luv_object_t* conn = _stream_test(s->L, 2);
+    if (uv_accept((uv_stream_t*)pipe, &conn->h.stream)) {
+      uv_err_t err = uv_last_error(pipe->loop);
+      lua_settop(s->L, 0);
+      lua_pushnil(s->L);
+      lua_pushstring(s->L, uv_strerror(err));
+    }
+    else {
+      lua_settop(s->L, 2);
+      lua_remove(s->L, 1);
+      lua_pushlstring(s->L, (char*)buf.base, len);
+    }
+    ngx_queue_remove(&s->cond);
+    luvL_state_ready(s);
+    if (!_accept_waiter(self)) self->flags &= ~LUV_OWAITING;
+  }
+  else {
+    _passed_push(self, (char*)buf.base, len);
+    self->count++;
+  }
+  if (buf.base) luvL_free(buf.base);
+  if (ngx_queue_empty(&self->rouse)) {
+    luvL_stream_stop(self);
+  }
+}
+
 static void _write_cb(uv_write_t* req, int status) {
   luv_state_t* rouse = container_of(req, luv_state_t, req);
   lua_settop(rouse->L, 0);
@@ -140,31 +254,49 @@ static int luv_stream_listen(lua_State* L) {
 
 static int luv_stream_accept(lua_State *L) {
   luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
-  luv_object_t* conn = (luv_object_t*)lua_touserdata(L, 2);
+  luv_object_t* conn = _stream_test(L, 2);
 
   luv_state_t* curr = luvL_state_self(L);
   luaL_checktype(L, 1, LUA_TUSERDATA);
+  luaL_argcheck(L, conn != NULL, 2, "tcp or pipe expected");
 
   if (self->count) {
     int rv;
+    luv_passed_t* passed = _passed_pop(self);
 	self->count--;
     rv = uv_accept(&self->h.stream, &conn->h.stream);
     if (rv) {
       uv_err_t err = uv_last_error(self->h.stream.loop);
+      free(passed);
       lua_settop(L, 0);
       lua_pushnil(L);
       lua_pushstring(L, uv_strerror(err));
       return 2;
     }
+    if (passed) {
+      /* a handle from an IPC pipe, with its bytes */
+      lua_settop(L, 2);
+      lua_pushlstring(L, passed->data, passed->len);
+      free(passed);
+      return 2;
+    }
     return 1;
   }
   self->flags |= LUV_OWAITING;
+  if (self->h.handle.type == UV_NAMED_PIPE && self->h.pipe.ipc) {
+    /* handles come in on the pipe's reads */
+    if (!self->buf.len) self->buf.len = LUV_BUF_SIZE;
+    luvL_stream_start(self);
+  }
   return luvL_cond_wait(&self->rouse, curr);
 }
 
 int luvL_stream_start(luv_object_t* self) {
   if (!luvL_object_is_started(self)) {
     self->flags |= LUV_OSTARTED;
+    if (self->h.handle.type == UV_NAMED_PIPE && self->h.pipe.ipc) {
+      return uv_read2_start(&self->h.stream, luvL_alloc_cb, _read2_cb);
+    }
     return uv_read_start(&self->h.stream, luvL_alloc_cb, _read_cb);
   }
   return 0;
@@ -223,7 +355,7 @@ static int luv_stream_read(lua_State* L) {
     TRACE("have pending data\n");
     lua_pushinteger(L, self->count);
     lua_pushlstring(L, (char*)self->buf.base, self->count);
-    free(self->buf.base);
+    luvL_free(self->buf.base);
     self->buf.base = NULL;
     self->buf.len  = 0;
     self->count    = 0;
@@ -247,8 +379,19 @@ static int luv_stream_write(lua_State* L) {
 
   luv_state_t* curr = luvL_state_self(L);
   uv_write_t*  req  = &curr->req.write;
+  int rv;
 
-  if (uv_write(req, &self->h.stream, &buf, 1, _write_cb)) {
+  if (lua_isnoneornil(L, 3)) {
+    rv = uv_write(req, &self->h.stream, &buf, 1, _write_cb);
+  }
+  else {
+    /* send a handle along over an IPC pipe */
+    luv_object_t* send = _stream_test(L, 3);
+    luaL_argcheck(L, send != NULL, 3, "tcp or pipe expected");
+    rv = uv_write2(req, &self->h.stream, &buf, 1, &send->h.stream, _write_cb);
+  }
+
+  if (rv) {
     luvL_stream_stop(self);
     luvL_object_close(self);
     STREAM_ERROR(L, "write: %s", luvL_event_loop(L));
@@ -259,6 +402,250 @@ static int luv_stream_write(lua_State* L) {
   return luvL_state_suspend(curr);
 }
 
+static luv_frame_t* _frame_get(luv_object_t* self) {
+  luv_frame_t* frame = (luv_frame_t*)self->data;
+  if (!(self->flags & LUV_OFRAMED)) {
+    frame = (luv_frame_t*)luvL_alloc(sizeof(luv_frame_t));
+    memset(frame, 0, sizeof(luv_frame_t));
+    if (self->buf.base) {
+      /* data read before the first recv */
+      frame->base = self->buf.base;
+      frame->len  = self->count;
+      frame->size = self->buf.len;
+      self->buf.base = NULL;
+      self->count    = 0;
+    }
+    self->data   = frame;
+    self->flags |= LUV_OFRAMED;
+  }
+  return frame;
+}
+
+static void _frame_free(luv_object_t* self) {
+  if (self->flags & LUV_OFRAMED) {
+    luv_frame_t* frame = (luv_frame_t*)self->data;
+    luvL_free(frame->base);
+    luvL_free(frame);
+    self->data   = NULL;
+    self->flags &= ~LUV_OFRAMED;
+  }
+}
+
+/* make room for `len' more bytes */
+static void _frame_need(luv_frame_t* frame, size_t len) {
+  char* base;
+  size_t size = frame->size ? frame->size : LUV_BUF_SIZE;
+  if (frame->head && frame->len + len > frame->size) {
+    /* drop what was consumed first */
+    memmove(frame->base, frame->base + frame->head, frame->len - frame->head);
+    frame->len -= frame->head;
+    frame->head = 0;
+  }
+  if (frame->len + len <= frame->size) return;
+  while (size < frame->len + len) size *= 2;
+  base = (char*)luvL_alloc(size);
+  if (frame->len) memcpy(base, frame->base, frame->len);
+  luvL_free(frame->base);
+  frame->base = base;
+  frame->size = size;
+}
+
+/* find the message at the head of the frame, returns 1 with its offset
+** and length if it is all there, 0 if more data is needed and -1 for a
+** bad length */
+static int _frame_peek(luv_frame_t* frame, size_t* ofs, size_t* len) {
+  const uint8_t* p = (const uint8_t*)frame->base + frame->head;
+  size_t avail = frame->len - frame->head;
+  size_t n = 0, v = 0;
+  int sh = 0;
+  for (;;) {
+    if (n == avail) return 0;
+    if (n == 5) return -1;
+    v |= (size_t)(p[n] & 0x7f) << sh;
+    sh += 7;
+    if (p[n++] < 0x80) break;
+  }
+  if (!v || v > LUV_FRAME_MAX) return -1;
+  if (avail - n < v) {
+    /* room for the rest of it in one go */
+    if (frame->size - frame->head < n + v) _frame_need(frame, n + v - avail);
+    return 0;
+  }
+  *ofs = frame->head + n;
+  *len = v;
+  return 1;
+}
+
+static int _frame_decode(lua_State* L) {
+  static const luv_codec_opts_t opts = { LUV_CODEC_DEPTH, LUV_FRAME_MAX, 0, 0 };
+  const char* data = (const char*)lua_touserdata(L, 1);
+  size_t len = (size_t)lua_tointeger(L, 2);
+  lua_settop(L, 0);
+  return luvL_codec_decode_from(L, data, len, NULL, &opts);
+}
+
+/* decode the message at ofs onto L, which must be running, leaving its
+** values or false and the error. Returns the number pushed */
+static int _frame_pop(luv_frame_t* frame, lua_State* L, size_t ofs, size_t len) {
+  int top = lua_gettop(L);
+  lua_pushcfunction(L, _frame_decode);
+  lua_pushlightuserdata(L, frame->base + ofs);
+  lua_pushinteger(L, (lua_Integer)len);
+  frame->head = ofs + len;
+  if (frame->head == frame->len) frame->head = frame->len = 0;
+  if (lua_pcall(L, 2, LUA_MULTRET, 0)) {
+    lua_pushboolean(L, 0);
+    lua_insert(L, -2);
+  }
+  return lua_gettop(L) - top;
+}
+
+/* push what recv returns at the end of the stream or for a bad length */
+static int _frame_end(luv_frame_t* frame, lua_State* L, int rv) {
+  if (rv < 0) {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "recv: bad message length");
+    return 2;
+  }
+  if (frame->eof < 0) {
+    lua_pushboolean(L, 0);
+    lua_pushfstring(L, "recv: %s", uv_strerror(frame->err));
+    return 2;
+  }
+  if (frame->len > frame->head) {
+    /* the stream ended inside a message */
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "recv: truncated message");
+    return 2;
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+/* hand whole messages to the states waiting in recv */
+static void _frame_deliver(luv_object_t* self) {
+  luv_frame_t* frame = (luv_frame_t*)self->data;
+  while (!ngx_queue_empty(&self->rouse)) {
+    ngx_queue_t* q = ngx_queue_head(&self->rouse);
+    luv_state_t* s = ngx_queue_data(q, luv_state_t, cond);
+    size_t ofs, len;
+    int rv = _frame_peek(frame, &ofs, &len);
+    if (!rv && !frame->eof) break;
+
+    ngx_queue_remove(q);
+    lua_settop(s->L, 0);
+    if (rv > 0) {
+      /* a suspended fiber can't run the decoder, its thread's state can */
+      lua_State* L = luvL_thread_current->L;
+      int n = _frame_pop(frame, L, ofs, len);
+      if (s->L != L) {
+        lua_checkstack(s->L, n);
+        lua_xmove(L, s->L, n);
+      }
+    }
+    else {
+      _frame_end(frame, s->L, rv);
+    }
+    luvL_state_ready(s);
+  }
+  if (ngx_queue_empty(&self->rouse) || frame->eof) {
+    luvL_stream_stop(self);
+  }
+}
+
+static void _frame_read_cb(luv_object_t* self, ssize_t len, uv_buf_t buf) {
+  luv_frame_t* frame = (luv_frame_t*)self->data;
+  if (len > 0) {
+    _frame_need(frame, (size_t)len);
+    memcpy(frame->base + frame->len, buf.base, (size_t)len);
+    frame->len += (size_t)len;
+  }
+  else if (len < 0) {
+    frame->err = uv_last_error(self->h.stream.loop);
+    frame->eof = frame->err.code == UV_EOF ? 1 : -1;
+  }
+  if (buf.base) luvL_free(buf.base);
+  _frame_deliver(self);
+}
+
+/* stream:send(...), encodes the values as one message and writes it
+** behind its length */
+static int luv_stream_send(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luv_state_t*  curr = luvL_state_self(L);
+  uv_write_t*   req  = &curr->req.write;
+  uv_buf_t bufs[2];
+  uint8_t  head[5];
+  size_t   len, n = 0;
+  const char* data;
+
+  if (self->flags & LUV_OCOMPRESS) {
+    luvL_codec_encode_z(L, lua_gettop(L) - 1);
+  }
+  else {
+    luvL_codec_encode(L, lua_gettop(L) - 1);
+  }
+  data = lua_tolstring(L, 2, &len);
+  if (len > LUV_FRAME_MAX) {
+    return luaL_error(L, "send: message too large (%d bytes)", (int)len);
+  }
+  for (; len >= 0x80; len >>= 7) {
+    head[n++] = (uint8_t)((len & 0x7f) | 0x80);
+  }
+  head[n++] = (uint8_t)len;
+
+  /* both stay on the stack until the write is done */
+  lua_pushlstring(L, (const char*)head, n);
+  bufs[0] = uv_buf_init((char*)lua_tostring(L, 3), n);
+  bufs[1] = uv_buf_init((char*)data, lua_rawlen(L, 2));
+
+  if (uv_write(req, &self->h.stream, bufs, 2, _write_cb)) {
+    luvL_stream_stop(self);
+    luvL_object_close(self);
+    STREAM_ERROR(L, "send: %s", luvL_event_loop(L));
+    return 2;
+  }
+  return luvL_state_suspend(curr);
+}
+
+/* stream:compress([enable]), whether send compresses messages */
+static int luv_stream_compress(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  if (!lua_isnoneornil(L, 2)) {
+    if (lua_toboolean(L, 2)) self->flags |= LUV_OCOMPRESS;
+    else self->flags &= ~LUV_OCOMPRESS;
+  }
+  lua_pushboolean(L, self->flags & LUV_OCOMPRESS);
+  return 1;
+}
+
+/* stream:recv(), the values of the next message, nil at the end of the
+** stream or false and an error */
+static int luv_stream_recv(lua_State* L) {
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luv_state_t*  curr = luvL_state_self(L);
+  luv_frame_t*  frame;
+
+  if (luvL_object_is_closing(self)) {
+    lua_pushnil(L);
+    lua_pushstring(L, "attempt to read from a closed stream");
+    return 2;
+  }
+  frame = _frame_get(self);
+
+  if (ngx_queue_empty(&self->rouse)) {
+    size_t ofs, len;
+    int rv = _frame_peek(frame, &ofs, &len);
+    lua_settop(L, 0);
+    if (rv > 0) return _frame_pop(frame, L, ofs, len);
+    if (rv < 0 || frame->eof) return _frame_end(frame, L, rv);
+  }
+
+  if (!self->buf.len) self->buf.len = LUV_BUF_SIZE;
+  luvL_stream_start(self);
+  return luvL_cond_wait(&self->rouse, curr);
+}
+
 static int luv_stream_shutdown(lua_State* L) {
   luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
   if (!luvL_object_is_shutdown(self)) {
@@ -288,10 +675,12 @@ void luvL_stream_close(luv_object_t* self) {
   }
   luvL_object_close(self);
   if (self->buf.base) {
-    free(self->buf.base);
+    luvL_free(self->buf.base);
     self->buf.base = NULL;
     self->buf.len  = 0;
   }
+  _frame_free(self);
+  _passed_free(self);
 }
 
 static int luv_stream_close(lua_State* L) {
@@ -304,10 +693,12 @@ void luvL_stream_free(luv_object_t* self) {
   luvL_object_close(self);
   TRACE("free stream: %p\n", self);
   if (self->buf.base) {
-    free(self->buf.base);
+    luvL_free(self->buf.base);
     self->buf.base = NULL;
     self->buf.len  = 0;
   }
+  _frame_free(self);
+  _passed_free(self);
 }
 
 static int luv_stream_free(lua_State* L) {
@@ -316,6 +707,118 @@ static int luv_stream_free(lua_State* L) {
   return 1;
 }
 
+/* A stream is passed to another thread as a duplicate of its descriptor,
+** listed under an id which goes in the encoded bytes. The decoder claims
+** it from the list and opens it on a new handle in the receiving thread,
+** so a descriptor has one owner at any time, and a second decode of the
+** same bytes fails. */
+typedef struct luv_shared_s {
+  struct luv_shared_s* next;
+  unsigned long   id;
+  int             fd;
+  int             kind;   /* 0 tcp, 1 pipe, 2 ipc pipe */
+} luv_shared_t;
+
+static uv_mutex_t    luv_shared_lock;  /* guards the list below */
+static luv_shared_t* luv_shared     = NULL;
+static unsigned long luv_shared_ids = 0;
+
+void luvL_stream_init(void) {
+  uv_mutex_init(&luv_shared_lock);
+}
+
+static int luv_stream_encoder(lua_State* L) {
+#ifndef WIN32
+  luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
+  luv_shared_t* e;
+  int kind, fd;
+  switch (self->h.handle.type) {
+    case UV_TCP:
+      kind = 0;
+      break;
+    case UV_NAMED_PIPE:
+      kind = self->h.pipe.ipc ? 2 : 1;
+      break;
+    default:
+      return luaL_error(L, "cannot encode a stream of this type");
+  }
+  if (luvL_object_is_closing(self)) {
+    return luaL_error(L, "cannot encode a closed stream");
+  }
+  fd = dup(self->h.stream.fd);
+  if (fd < 0) {
+    return luaL_error(L, "cannot encode stream: %s", strerror(errno));
+  }
+
+  e = (luv_shared_t*)malloc(sizeof(luv_shared_t));
+  e->fd   = fd;
+  e->kind = kind;
+  uv_mutex_lock(&luv_shared_lock);
+  e->id   = ++luv_shared_ids;
+  e->next = luv_shared;
+  luv_shared = e;
+  uv_mutex_unlock(&luv_shared_lock);
+
+  lua_pushstring(L, "luv:stream:decoder");
+  lua_pushnumber(L, (lua_Number)e->id);
+  return 2;
+#else
+  return luaL_error(L, "streams cannot be passed between threads on this platform");
+#endif
+}
+
+int luvL_stream_decoder(lua_State* L) {
+  luv_state_t*  curr = luvL_state_self(L);
+  unsigned long id = (unsigned long)luaL_checknumber(L, -1);
+  luv_object_t* self;
+  luv_shared_t* e;
+  int fd = -1, kind = 0, rv;
+
+#ifndef WIN32
+  luv_shared_t** p;
+  uv_mutex_lock(&luv_shared_lock);
+  for (p = &luv_shared; *p && (*p)->id != id; p = &(*p)->next);
+  e = *p;
+  if (e) *p = e->next;
+  uv_mutex_unlock(&luv_shared_lock);
+  if (!e) {
+    return luaL_error(L, "cannot decode stream: already decoded");
+  }
+  fd   = e->fd;
+  kind = e->kind;
+  free(e);
+#else
+  (void)e;
+  return luaL_error(L, "streams cannot be passed between threads on this platform");
+#endif
+
+  self = (luv_object_t*)lua_newuserdata(L, sizeof(luv_object_t));
+  luaL_getmetatable(L, kind ? LUV_PIPE_T : LUV_NET_TCP_T);
+  lua_setmetatable(L, -2);
+  luvL_object_init(curr, self);
+
+#ifndef WIN32
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+  if (kind) {
+    uv_pipe_init(curr->loop, &self->h.pipe, kind == 2);
+    rv = uv_pipe_open(&self->h.pipe, fd);
+  }
+  else {
+    uv_tcp_init(curr->loop, &self->h.tcp);
+    rv = uv_tcp_open(&self->h.tcp, fd);
+  }
+  if (rv) {
+    /* the handle is closed when the userdata is collected */
+    uv_err_t err = uv_last_error(curr->loop);
+#ifndef WIN32
+    close(fd);
+#endif
+    return luaL_error(L, "cannot decode stream: %s", uv_strerror(err));
+  }
+  return 1;
+}
+
 static int luv_stream_tostring(lua_State* L) {
   luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
   lua_pushfstring(L, "userdata<luv.stream>: %p", self);
@@ -326,6 +829,9 @@ luaL_Reg luv_stream_meths[] = {
   {"read",      luv_stream_read},
   {"readable",  luv_stream_readable},
   {"write",     luv_stream_write},
+  {"send",      luv_stream_send},
+  {"recv",      luv_stream_recv},
+  {"compress",  luv_stream_compress},
   {"writable",  luv_stream_writable},
   {"start",     luv_stream_start},
   {"stop",      luv_stream_stop},
@@ -333,6 +839,7 @@ luaL_Reg luv_stream_meths[] = {
   {"accept",    luv_stream_accept},
   {"shutdown",  luv_stream_shutdown},
   {"close",     luv_stream_close},
+  {"__codec",   luv_stream_encoder},
   {"__gc",      luv_stream_free},
   {"__tostring",luv_stream_tostring},
   {NULL,        NULL}
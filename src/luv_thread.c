@@ -1,5 +1,7 @@
 #include "luv.h"
 
+LUV_THREAD_LOCAL luv_thread_t* luvL_thread_current = NULL;
+
 void luvL_thread_ready(luv_thread_t* self) {
   if (!(self->flags & LUV_FREADY)) {
     TRACE("SET READY\n");
@@ -18,21 +20,44 @@ int luvL_thread_yield(luv_thread_t* self, int narg) {
   return narg;
 }
 
+static void _idle_cb(uv_idle_t* handle, int status) {
+  (void)handle;
+  (void)status;
+}
+
 int luvL_thread_suspend(luv_thread_t* self) {
   if (self->flags & LUV_FREADY) {
     int active = 0;
+    int more   = 0;
+#ifdef LUV_STATS
+    uint64_t poll_start;
+#endif
     self->flags &= ~LUV_FREADY;
     do {
       TRACE("loop top\n");
-      luvL_thread_loop(self);
+      more = luvL_thread_loop(self);
 	  if (self->flags & LUV_FREADY) {
         TRACE("main ready, breaking\n");
         break;
       }
-	  active = uv_run_once(self->loop);
+#ifdef LUV_STATS
+      poll_start = uv_hrtime();
+#endif
+      if (more) {
+        /* out of budget, poll for I/O without blocking and carry on */
+        TRACE("budget exhausted\n");
+        uv_idle_start(&self->idle, _idle_cb);
+        active = uv_run_once(self->loop);
+        uv_idle_stop(&self->idle);
+      }
+      else {
+        active = uv_run_once(self->loop);
+      }
+      LUV_STAT(self->stats.loops++);
+      LUV_STAT(self->stats.poll_time += uv_hrtime() - poll_start);
 	  TRACE("uv_run_once returned, active: %i\n", active);
     }
-    while (active);
+    while (active || more);
     TRACE("back in main\n");
     /* nothing left to do, back in main */
     self->flags |= LUV_FREADY;
@@ -62,9 +87,69 @@ int luvL_thread_resume(luv_thread_t* self, int narg) {
   }
   return narg;
 }
+/* lowest set bit of a non-zero priority mask */
+static int _prio_first(unsigned int mask) {
+#ifdef __GNUC__
+  return __builtin_ctz(mask);
+#else
+  int n = 0;
+  while (!(mask & 1)) { mask >>= 1; n++; }
+  return n;
+#endif
+}
+
+static void _sched_init(luv_thread_t* self) {
+  int i;
+  for (i = 0; i < LUV_NPRIO; i++) {
+    ngx_queue_init(&self->ready[i]);
+  }
+  self->ready_mask = 0;
+  self->aging      = 0;
+  self->picks      = 0;
+  self->aged       = LUV_NPRIO - 1;
+  self->budget     = 0;
+  self->slice      = 0;
+  LUV_STAT(memset(&self->stats, 0, sizeof(self->stats)));
+  uv_idle_init(self->loop, &self->idle);
+}
+
+static void _sched_push(luv_thread_t* self, luv_fiber_t* fiber) {
+  ngx_queue_insert_tail(&self->ready[fiber->prio], &fiber->queue);
+  self->ready_mask |= 1U << fiber->prio;
+#ifdef LUV_STATS
+  fiber->stats.ready_at = uv_hrtime();
+  if (++self->stats.depth > self->stats.max_depth) {
+    self->stats.max_depth = self->stats.depth;
+  }
+#endif
+}
+
+static luv_fiber_t* _sched_pop(luv_thread_t* self) {
+  ngx_queue_t* q;
+  int prio = _prio_first(self->ready_mask);
+  if (self->aging && ++self->picks >= self->aging) {
+    /* let the less urgent levels take turns so none of them can starve,
+    ** going round from the one after the level served last time */
+    unsigned int rest = self->ready_mask & ~(1U << prio);
+    self->picks = 0;
+    if (rest) {
+      unsigned int next = rest & ~((2U << self->aged) - 1);
+      prio = _prio_first(next ? next : rest);
+      self->aged = prio;
+    }
+  }
+  q = ngx_queue_head(&self->ready[prio]);
+  ngx_queue_remove(q);
+  if (ngx_queue_empty(&self->ready[prio])) {
+    self->ready_mask &= ~(1U << prio);
+  }
+  LUV_STAT(self->stats.depth--);
+  return ngx_queue_data(q, luv_fiber_t, queue);
+}
+
 void luvL_thread_enqueue(luv_thread_t* self, luv_fiber_t* fiber) {
-  int need_async = ngx_queue_empty(&self->rouse);
-  ngx_queue_insert_tail(&self->rouse, &fiber->queue);
+  int need_async = !self->ready_mask;
+  _sched_push(self, fiber);
   if (need_async) {
     TRACE("need async\n");
     /* interrupt the event loop (the sequence of these two calls matters) */
@@ -73,24 +158,32 @@ void luvL_thread_enqueue(luv_thread_t* self, luv_fiber_t* fiber) {
     uv_ref((uv_handle_t*)&self->async);
   }
 }
+void luvL_thread_dequeue(luv_thread_t* self, luv_fiber_t* fiber) {
+  ngx_queue_remove(&fiber->queue);
+  if (ngx_queue_empty(&self->ready[fiber->prio])) {
+    self->ready_mask &= ~(1U << fiber->prio);
+  }
+  LUV_STAT(self->stats.depth--);
+}
 luv_thread_t* luvL_thread_self(lua_State* L) {
-  luv_state_t* self = luvL_state_self(L);
+  luv_state_t* self;
+  luv_thread_t* thread = luvL_thread_current;
+  if (thread && thread->curr->L == L) {
+    return thread;
+  }
+  self = luvL_state_self(L);
   if (self->type == LUV_TTHREAD) {
     return (luv_thread_t*)self;
   }
   else {
-    while (self->type != LUV_TTHREAD) self = self->outer;
-    return (luv_thread_t*)self;
+    /* fibers are always created with their thread as outer */
+    return (luv_thread_t*)self->outer;
   }
 }
 
 int luvL_thread_once(luv_thread_t* self) {
-  if (!ngx_queue_empty(&self->rouse)) {
-    ngx_queue_t* q;
-    luv_fiber_t* fiber;
-    q = ngx_queue_head(&self->rouse);
-    fiber = ngx_queue_data(q, luv_fiber_t, queue);
-    ngx_queue_remove(q);
+  if (self->ready_mask) {
+    luv_fiber_t* fiber = _sched_pop(self);
     TRACE("[%p] rouse fiber: %p\n", self, fiber);
     if (fiber->flags & LUV_FDEAD) {
       TRACE("[%p] fiber is dead: %p\n", self, fiber);
@@ -98,6 +191,9 @@ int luvL_thread_once(luv_thread_t* self) {
     }
     else {
       int stat, narg;
+#ifdef LUV_STATS
+      uint64_t start;
+#endif
       narg = lua_gettop(fiber->L);
 
       if (!(fiber->flags & LUV_FSTART)) {
@@ -106,11 +202,19 @@ int luvL_thread_once(luv_thread_t* self) {
         --narg;
       }
 
+#ifdef LUV_STATS
+      start = uv_hrtime();
+      fiber->stats.wait_time += start - fiber->stats.ready_at;
+      fiber->stats.resumes++;
+      self->stats.resumes++;
+#endif
       self->curr = (luv_state_t*)fiber;
       TRACE("[%p] calling lua_resume on: %p\n", self, fiber);
+      luvL_hook_arm(fiber->L);
       stat = lua_resume(fiber->L, self->L, narg);
       TRACE("resume returned\n");
       self->curr = (luv_state_t*)self;
+      LUV_STAT(fiber->stats.run_time += uv_hrtime() - start);
 
       switch (stat) {
         case LUA_YIELD:
@@ -118,7 +222,7 @@ int luvL_thread_once(luv_thread_t* self) {
           /* if called via coroutine.yield() then we're still in the queue */
           if (fiber->flags & LUV_FREADY) {
             TRACE("%p is still ready, back in the queue\n", fiber);
-            ngx_queue_insert_tail(&self->rouse, &fiber->queue);
+            _sched_push(self, fiber);
           }
           break;
         case 0: {
@@ -156,96 +260,246 @@ int luvL_thread_once(luv_thread_t* self) {
       }
     }
   }
-  return !ngx_queue_empty(&self->rouse);
+  return self->ready_mask != 0;
 }
+/* run ready fibers until the queue is drained or the tick's budget is
+** spent, returns non-zero if fibers are still waiting */
 int luvL_thread_loop(luv_thread_t* self) {
-  while (luvL_thread_once(self));
+  unsigned int count = 0;
+  uint64_t     start = 0;
+  if (self->slice) start = uv_hrtime();
+  while (luvL_thread_once(self)) {
+    if (self->budget && ++count >= self->budget) return 1;
+    if (self->slice && uv_hrtime() - start >= self->slice) return 1;
+  }
   return 0;
 }
 
 static void _async_cb(uv_async_t* handle, int status) {
+  luv_thread_t* self = container_of(handle, luv_thread_t, async);
   TRACE("interrupt loop\n");
-  (void)handle;
   (void)status;
+  luvL_chan_wakeup(self);
 }
 
-void luvL_thread_init_main(lua_State* L) {
-  luv_thread_t* self = (luv_thread_t*)lua_newuserdata(L, sizeof(luv_thread_t));
-  luaL_getmetatable(L, LUV_THREAD_T);
-  lua_setmetatable(L, -2);
-
+/* set up a luv thread driving `loop' from `L' */
+void luvL_thread_init(luv_thread_t* self, lua_State* L, uv_loop_t* loop, luv_state_t* outer) {
   self->type  = LUV_TTHREAD;
   self->flags = LUV_FREADY;
-  self->loop  = uv_default_loop();
+  self->loop  = loop;
   self->curr  = (luv_state_t*)self;
   self->L     = L;
-  self->outer = (luv_state_t*)self;
+  self->outer = outer ? outer : (luv_state_t*)self;
   self->data  = NULL;
-  self->tid   = (uv_thread_t)uv_thread_self();
+  self->result = NULL;
+  self->result_len = 0;
+
+  self->pool_size = 0;
+  self->pool_max  = 0;
+  self->alloc     = &self->heap;
 
   ngx_queue_init(&self->rouse);
+  ngx_queue_init(&self->chans);
+  ngx_queue_init(&self->pool);
+  _sched_init(self);
+  luvL_wheel_init(&self->wheel, self->loop);
+  luvL_lag_init(self);
 
   uv_async_init(self->loop, &self->async, _async_cb);
   uv_unref((uv_handle_t*)&self->async);
+}
+
+/* the main state outlives its luv_thread_t userdata, so its allocator
+** can't live in there */
+static luv_alloc_t luv_main_alloc;
+
+void luvL_thread_init_main(lua_State* L) {
+  luv_thread_t* self;
+  void* ud;
+  lua_Alloc base = lua_getallocf(L, &ud);
+
+  /* keep the host's allocator, only count what goes through it */
+  luvL_alloc_init(&luv_main_alloc, base, ud);
+  luv_main_alloc.bytes = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024
+                       + (size_t)lua_gc(L, LUA_GCCOUNTB, 0);
+  luv_main_alloc.peak  = luv_main_alloc.bytes;
+  lua_setallocf(L, luvL_lua_alloc, &luv_main_alloc);
+
+  self = (luv_thread_t*)lua_newuserdata(L, sizeof(luv_thread_t));
+  luaL_getmetatable(L, LUV_THREAD_T);
+  lua_setmetatable(L, -2);
+
+  luvL_thread_init(self, L, uv_default_loop(), NULL);
+  self->alloc = &luv_main_alloc;
+  self->tid = (uv_thread_t)uv_thread_self();
 
   lua_pushthread(L);
   lua_pushvalue(L, -2);
   lua_rawset(L, LUA_REGISTRYINDEX);
+
+  luvL_thread_current = self;
 }
 
-static void _thread_enter(void* arg) {
-  luv_thread_t* self = (luv_thread_t*)arg;
-  int nargs,rv;
-  luvL_codec_decode(self->L);
-  lua_remove(self->L, 1);
+/* the payload decoded into the function and its arguments, then called,
+** all under the pcall in luvL_thread_run as decoding can fail too */
+static int _thread_body(lua_State* L) {
+  luvL_codec_decode(L);
+  lua_remove(L, 1);
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+  return lua_gettop(L);
+}
 
-  luaL_checktype(self->L, 1, LUA_TFUNCTION);
+/* decode the function and arguments at index 1 of self->L and call it,
+** leaving true and its results, or false and the error, on the stack */
+void luvL_thread_run(luv_thread_t* self) {
+  int rv;
   lua_pushcfunction(self->L, luvL_traceback);
   lua_insert(self->L, 1);
-  nargs = lua_gettop(self->L) - 2;
+  lua_pushcfunction(self->L, _thread_body);
+  lua_insert(self->L, 2);
 
-  rv = lua_pcall(self->L, nargs, LUA_MULTRET, 1);
+  rv = lua_pcall(self->L, 1, LUA_MULTRET, 1);
   lua_remove(self->L, 1); /* traceback */
 
-  if (rv) { /* error */
+  if (rv) { /* error, passed on to the joiner as false, message */
     lua_pushboolean(self->L, 0);
     lua_insert(self->L, 1);
-    luvL_thread_ready(self);
-    luaL_error(self->L, lua_tostring(self->L, -1));
   }
   else {
     lua_pushboolean(self->L, 1);
     lua_insert(self->L, 1);
   }
+}
+
+static void _thread_enter(void* arg) {
+  luv_thread_t* self = (luv_thread_t*)arg;
+  luvL_thread_current = self;
+  luvL_thread_run(self);
 
   self->flags |= LUV_FDEAD;
+  luvL_chan_detach(self);
+  luvL_watchdog_stop(self);
+  luvL_codec_release();
+
+  /* wake up the parent's loop, we're done with self->L from here on */
+  uv_async_send(&self->finish);
+}
+
+static int _thread_encode(lua_State* L) {
+  luvL_codec_encode(L, lua_gettop(L));
+  return 1;
+}
+
+/* encode what the thread left on its stack once, for all joiners */
+static void _thread_keep(luv_thread_t* self) {
+  lua_State* L = self->L;
+  const char* data;
+  size_t len;
+
+  lua_pushcfunction(L, _thread_encode);
+  lua_insert(L, 1);
+  if (lua_pcall(L, lua_gettop(L) - 1, 1, 0)) {
+    /* results which can't be sent back become an error */
+    lua_pushboolean(L, 0);
+    lua_insert(L, -2);
+    luvL_codec_encode(L, 2);
+  }
+  data = lua_tolstring(L, -1, &len);
+  self->result = (char*)malloc(len);
+  self->result_len = len;
+  memcpy(self->result, data, len);
+  lua_settop(L, 0);
+}
+
+static int _thread_decode(lua_State* L) {
+  luv_thread_t* self = (luv_thread_t*)lua_touserdata(L, 1);
+  lua_pop(L, 1);
+  luvL_codec_decode_from(L, self->result, self->result_len, NULL, NULL);
+  return lua_gettop(L);
+}
+
+/* push the results of a finished thread onto the stack of L, decoded on
+** RL, the running state, as L may be a suspended fiber */
+static int _thread_results(luv_thread_t* self, lua_State* RL, lua_State* L) {
+  int base = lua_gettop(RL);
+  int nret;
+
+  lua_pushcfunction(RL, _thread_decode);
+  lua_pushlightuserdata(RL, (void*)self);
+  if (lua_pcall(RL, 1, LUA_MULTRET, 0)) {
+    lua_pushboolean(RL, 0);
+    lua_insert(RL, -2);
+  }
+  nret = lua_gettop(RL) - base;
+  if (RL != L) lua_xmove(RL, L, nret);
+  return nret;
+}
+
+static void _finish_close_cb(uv_handle_t* handle) {
+  luv_thread_t* self = container_of(handle, luv_thread_t, finish);
+  lua_State* L = luvL_thread_current->L;
+  /* release the anchor taken in luvL_thread_create */
+  lua_pushlightuserdata(L, (void*)self);
+  lua_pushnil(L);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+static void _finish_cb(uv_async_t* handle, int status) {
+  luv_thread_t* self = container_of(handle, luv_thread_t, finish);
+  ngx_queue_t* q;
+  luv_state_t* s;
+  (void)status;
+
+  TRACE("thread finished: %p\n", self);
+  uv_thread_join(&self->tid); /* already on its way out */
+  self->flags |= LUV_FJOIN;
+  _thread_keep(self);
+
+  /* wake up joining states, fibers get the results on their stack */
+  while (!ngx_queue_empty(&self->rouse)) {
+    q = ngx_queue_head(&self->rouse);
+    s = ngx_queue_data(q, luv_state_t, join);
+    ngx_queue_remove(q);
+    if (s->type == LUV_TFIBER) {
+      lua_settop(s->L, 0);
+      _thread_results(self, luvL_thread_current->L, s->L);
+    }
+    luvL_state_ready(s);
+  }
+
+  uv_close((uv_handle_t*)handle, _finish_close_cb);
 }
 
 luv_thread_t* luvL_thread_create(luv_state_t* outer, int narg) {
   lua_State* L = outer->L;
   int base;
   luv_thread_t* self;
+  lua_State* TL;
 
   /* ..., func, arg1, ..., argN */
   base = lua_gettop(L) - narg + 1;
 
   self = (luv_thread_t*)lua_newuserdata(L, sizeof(luv_thread_t));
+  TL = luvL_newstate(&self->heap);
+  if (!TL) {
+    /* no metatable yet, so the userdata goes without a __gc */
+    luaL_error(L, "thread: cannot create a Lua state");
+  }
   luaL_getmetatable(L, LUV_THREAD_T);
   lua_setmetatable(L, -2);
-  lua_insert(L, base++);
 
-  self->type  = LUV_TTHREAD;
-  self->flags = LUV_FREADY;
-  self->loop  = uv_loop_new();
-  self->curr  = (luv_state_t*)self;
-  self->L     = luaL_newstate();
-  self->outer = outer;
-  self->data  = NULL;
+  /* keep it alive until the finish handle is closed */
+  lua_pushlightuserdata(L, (void*)self);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, LUA_REGISTRYINDEX);
 
-  ngx_queue_init(&self->rouse);
+  lua_insert(L, base++);
 
-  uv_async_init(self->loop, &self->async, _async_cb);
-  uv_unref((uv_handle_t*)&self->async);
+  luvL_thread_init(self, TL, uv_loop_new(), outer);
+
+  /* stays referenced, so the parent's loop runs until we're done */
+  uv_async_init(outer->loop, &self->finish, _finish_cb);
 
   luaL_openlibs(self->L);
   luaopen_luv(self->L);
@@ -277,25 +531,37 @@ static int luv_new_thread(lua_State* L) {
 }
 static int luv_thread_join(lua_State* L) {
   luv_thread_t* self = (luv_thread_t*)luaL_checkudata(L, 1, LUV_THREAD_T);
-  luv_thread_t* curr = luvL_thread_self(L);
-  int nret;
-
-  luvL_thread_ready(self);
-  luvL_thread_suspend(curr);
-  uv_thread_join(&self->tid); /* XXX: use async instead, this blocks hard */
+  luv_state_t*  curr = luvL_state_self(L);
+
+  if (!(self->flags & LUV_FJOIN)) {
+    TRACE("joining thread[%p], from [%p]\n", self, curr);
+    ngx_queue_insert_tail(&self->rouse, &curr->join);
+    if (curr->type == LUV_TFIBER) {
+      /* _finish_cb leaves the results on our stack */
+      return luvL_state_suspend(curr);
+    }
+    while (!(self->flags & LUV_FJOIN)) {
+      luvL_state_suspend(curr);
+    }
+  }
 
   lua_settop(L, 0);
-
-  nret = lua_gettop(self->L);
-  luvL_codec_encode(self->L, nret);
-  lua_xmove(self->L, L, 1);
-  luvL_codec_decode(L);
-
-  return nret;
+  return _thread_results(self, L, L);
+}
+static int luv_thread_done(lua_State* L) {
+  luv_thread_t* self = (luv_thread_t*)luaL_checkudata(L, 1, LUV_THREAD_T);
+  lua_pushboolean(L, self->flags & LUV_FJOIN);
+  return 1;
 }
 static int luv_thread_free(lua_State* L) {
   luv_thread_t* self = lua_touserdata(L, 1);
   TRACE("free thread\n");
+  if (self->flags & LUV_FJOIN) {
+    /* joined, so nothing runs in its state any more */
+    lua_close(self->L);
+    luvL_alloc_release(&self->heap);
+  }
+  free(self->result);
   uv_loop_delete(self->loop);
   TRACE("ok\n");
   return 1;
@@ -306,13 +572,107 @@ static int luv_thread_tostring(lua_State* L) {
   return 1;
 }
 
+/* field `key' of the config table into `val', which must not be below 0
+** as the settings are unsigned. Returns 0 if it isn't set */
+static int _config_get(lua_State* L, const char* key, lua_Number* val) {
+  lua_getfield(L, 1, key);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  *val = lua_tonumber(L, -1);
+  luaL_argcheck(L, lua_isnumber(L, -1) && *val >= 0, 1,
+    lua_pushfstring(L, "%s must be a number not below 0", key));
+  lua_pop(L, 1);
+  return 1;
+}
+
+/* luv.scheduler.config{ aging = n, budget = n, slice = usec, slack = msec } */
+static int luv_scheduler_config(lua_State* L) {
+  luv_thread_t* self = luvL_thread_self(L);
+  lua_Number val;
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (_config_get(L, "aging", &val)) {
+      self->aging = (unsigned int)val;
+      self->picks = 0;
+    }
+    if (_config_get(L, "budget", &val)) {
+      self->budget = (unsigned int)val;
+    }
+    if (_config_get(L, "slice", &val)) {
+      self->slice = (uint64_t)(val * 1000);
+    }
+    if (_config_get(L, "slack", &val)) {
+      self->wheel.slack = (uint64_t)val;
+    }
+  }
+  lua_settop(L, 0);
+  lua_newtable(L);
+  lua_pushinteger(L, self->aging);
+  lua_setfield(L, -2, "aging");
+  lua_pushinteger(L, self->budget);
+  lua_setfield(L, -2, "budget");
+  lua_pushnumber(L, (lua_Number)self->slice / 1000);
+  lua_setfield(L, -2, "slice");
+  lua_pushinteger(L, (lua_Integer)self->wheel.slack);
+  lua_setfield(L, -2, "slack");
+  return 1;
+}
+
+/* counters of the current thread, nil unless built with LUV_STATS */
+static int luv_thread_stats(lua_State* L) {
+#ifdef LUV_STATS
+  luv_thread_t* self = luvL_thread_self(L);
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, (lua_Number)self->stats.resumes);
+  lua_setfield(L, -2, "resumes");
+  lua_pushnumber(L, (lua_Number)self->stats.loops);
+  lua_setfield(L, -2, "loops");
+  lua_pushnumber(L, (lua_Number)self->stats.poll_time);
+  lua_setfield(L, -2, "poll_time");
+  lua_pushinteger(L, self->stats.depth);
+  lua_setfield(L, -2, "ready");
+  lua_pushinteger(L, self->stats.max_depth);
+  lua_setfield(L, -2, "ready_max");
+#else
+  lua_pushnil(L);
+#endif
+  return 1;
+}
+
+/* allocator counters of the current thread, in bytes */
+static int luv_thread_memory(lua_State* L) {
+  luv_alloc_t* self = luvL_thread_self(L)->alloc;
+  int reset = lua_toboolean(L, 1);
+
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, (lua_Number)self->bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, (lua_Number)self->peak);
+  lua_setfield(L, -2, "peak");
+  lua_pushnumber(L, (lua_Number)self->reserved);
+  lua_setfield(L, -2, "reserved");
+
+  if (reset) self->peak = self->bytes;
+  return 1;
+}
+
+luaL_Reg luv_scheduler_funcs[] = {
+  {"config",    luv_scheduler_config},
+  {NULL,        NULL}
+};
+
 luaL_Reg luv_thread_funcs[] = {
   {"spawn",     luv_new_thread},
+  {"stats",     luv_thread_stats},
+  {"memory",    luv_thread_memory},
   {NULL,        NULL}
 };
 
 luaL_Reg luv_thread_meths[] = {
   {"join",      luv_thread_join},
+  {"done",      luv_thread_done},
   {"__gc",      luv_thread_free},
   {"__tostring",luv_thread_tostring},
   {NULL,        NULL}
@@ -1,14 +1,212 @@
 #include "luv.h"
 
-static void _timer_cb(uv_timer_t* handle, int status) {
-  luv_object_t* self = container_of(handle, luv_object_t, h);
+/* Hierarchical timing wheel (as in the classic BSD/Linux timer wheels)
+** with 1ms ticks. Level 0 holds timeouts due within the next 64 ticks,
+** each level above covers 64 times the range of the one below and is
+** cascaded down as the lower levels wrap. All timeouts of a thread share
+** one uv_timer_t armed for the next tick with anything to do. */
+
+#define _wheel_shift(l) ((l) * LUV_WHEEL_BITS)
+#define _wheel_span     ((uint64_t)1 << _wheel_shift(LUV_WHEEL_LEVELS))
+
+static void _wheel_add(luv_wheel_t* w, luv_timeout_t* t) {
+  uint64_t due = t->due;
+  uint64_t delta;
+  int level;
+
+  if (due < w->base) due = w->base; /* overdue, run on the next tick */
+  delta = due - w->base;
+  if (delta >= _wheel_span) {
+    /* parked on the top level, re-filed when it cascades */
+    due   = w->base + _wheel_span - 1;
+    delta = _wheel_span - 1;
+  }
+  for (level = 0; level < LUV_WHEEL_LEVELS - 1; level++) {
+    if (delta < ((uint64_t)1 << _wheel_shift(level + 1))) break;
+  }
+  t->level = level;
+  w->nlevel[level]++;
+  ngx_queue_insert_tail(
+    &w->slots[level][(due >> _wheel_shift(level)) & LUV_WHEEL_MASK],
+    &t->queue
+  );
+}
+
+/* next tick at which the wheel has work, only valid if w->count */
+static uint64_t _wheel_next(luv_wheel_t* w) {
+  uint64_t next = (uint64_t)-1;
+  int level;
+  for (level = 1; level < LUV_WHEEL_LEVELS; level++) {
+    if (w->nlevel[level]) {
+      /* lower levels wrap to 0 here and pull the slot down */
+      uint64_t span = (uint64_t)1 << _wheel_shift(level);
+      next = (w->base + span - 1) & ~(span - 1);
+      break;
+    }
+  }
+  if (w->nlevel[0]) {
+    uint64_t tick;
+    for (tick = w->base; tick < w->base + LUV_WHEEL_SLOTS; tick++) {
+      if (tick >= next) break;
+      if (!ngx_queue_empty(&w->slots[0][tick & LUV_WHEEL_MASK])) {
+        return tick;
+      }
+    }
+  }
+  return next;
+}
+
+static void _wheel_cascade(luv_wheel_t* w, int level) {
+  ngx_queue_t* slot;
+  ngx_queue_t  list;
+  slot = &w->slots[level][(w->base >> _wheel_shift(level)) & LUV_WHEEL_MASK];
+  if (ngx_queue_empty(slot)) return;
+
+  ngx_queue_init(&list);
+  ngx_queue_add(&list, slot);
+  ngx_queue_init(slot);
+
+  while (!ngx_queue_empty(&list)) {
+    ngx_queue_t* q = ngx_queue_head(&list);
+    luv_timeout_t* t = ngx_queue_data(q, luv_timeout_t, queue);
+    ngx_queue_remove(q);
+    w->nlevel[level]--;
+    _wheel_add(w, t);
+  }
+}
+
+static void _wheel_cb(uv_timer_t* handle, int status);
+
+static void _wheel_arm(luv_wheel_t* w) {
+  uint64_t now, next;
+  if (!w->count) {
+    uv_timer_stop(&w->timer);
+    w->armed = (uint64_t)-1;
+    return;
+  }
+  next = _wheel_next(w);
+  if (next == w->armed && uv_is_active((uv_handle_t*)&w->timer)) return;
+  now = (uint64_t)uv_now(w->timer.loop);
+  w->armed = next;
+  uv_timer_start(&w->timer, _wheel_cb, next > now ? next - now : 0, 0);
+}
+
+static void _wheel_run(luv_wheel_t* w, uint64_t now) {
+  while (w->count) {
+    ngx_queue_t* slot;
+    ngx_queue_t  list;
+    int level;
+    uint64_t next = _wheel_next(w);
+    if (next > now) break;
+
+    w->base = next;
+    for (level = 1; level < LUV_WHEEL_LEVELS; level++) {
+      if (w->base & (((uint64_t)1 << _wheel_shift(level)) - 1)) break;
+      _wheel_cascade(w, level);
+    }
+
+    slot = &w->slots[0][w->base & LUV_WHEEL_MASK];
+    w->base++;
+    if (ngx_queue_empty(slot)) continue;
+
+    ngx_queue_init(&list);
+    ngx_queue_add(&list, slot);
+    ngx_queue_init(slot);
+
+    while (!ngx_queue_empty(&list)) {
+      ngx_queue_t* q = ngx_queue_head(&list);
+      luv_timeout_t* t = ngx_queue_data(q, luv_timeout_t, queue);
+      ngx_queue_remove(q);
+      ngx_queue_init(q);
+      w->nlevel[0]--;
+      w->count--;
+      if (t->repeat) {
+        t->due = now + t->repeat;
+        w->count++;
+        _wheel_add(w, t);
+      }
+      t->cb(t);
+    }
+  }
+  if (w->base < now) w->base = now;
+}
+
+static void _wheel_cb(uv_timer_t* handle, int status) {
+  luv_wheel_t* w = container_of(handle, luv_wheel_t, timer);
+  (void)status;
+  w->armed = (uint64_t)-1;
+  _wheel_run(w, (uint64_t)uv_now(handle->loop));
+  _wheel_arm(w);
+}
+
+void luvL_wheel_init(luv_wheel_t* w, uv_loop_t* loop) {
+  int level, slot;
+  uv_timer_init(loop, &w->timer);
+  w->base  = (uint64_t)uv_now(loop);
+  w->armed = (uint64_t)-1;
+  w->slack = 0;
+  w->count = 0;
+  for (level = 0; level < LUV_WHEEL_LEVELS; level++) {
+    w->nlevel[level] = 0;
+    for (slot = 0; slot < LUV_WHEEL_SLOTS; slot++) {
+      ngx_queue_init(&w->slots[level][slot]);
+    }
+  }
+}
+
+void luvL_timeout_init(luv_timeout_t* self, luv_wheel_t* wheel, luv_timeout_cb cb) {
+  ngx_queue_init(&self->queue);
+  self->due    = 0;
+  self->repeat = 0;
+  self->level  = 0;
+  self->wheel  = wheel;
+  self->cb     = cb;
+  self->data   = NULL;
+}
+
+void luvL_timeout_start(luv_timeout_t* self, uint64_t timeout, uint64_t repeat) {
+  luv_wheel_t* w = self->wheel;
+  uint64_t now = (uint64_t)uv_now(w->timer.loop);
+
+  luvL_timeout_stop(self);
+  if (!w->count && w->base < now) w->base = now;
+
+  self->due    = now + timeout;
+  self->repeat = repeat;
+  if (w->slack && timeout) {
+    /* round up to a power of two boundary within the slack, so that
+    ** nearby deadlines land on the same tick */
+    uint64_t grain = 1;
+    while (grain * 2 <= w->slack) grain *= 2;
+    self->due = (self->due + grain - 1) & ~(grain - 1);
+  }
+
+  w->count++;
+  _wheel_add(w, self);
+  if (self->due < w->armed) _wheel_arm(w);
+}
+
+void luvL_timeout_stop(luv_timeout_t* self) {
+  if (!ngx_queue_empty(&self->queue)) {
+    luv_wheel_t* w = self->wheel;
+    ngx_queue_remove(&self->queue);
+    ngx_queue_init(&self->queue);
+    w->nlevel[self->level]--;
+    w->count--;
+    /* an early wake up is harmless, disarm only when idle */
+    if (!w->count) _wheel_arm(w);
+  }
+}
+
+static void _timer_cb(luv_timeout_t* timeout) {
+  luv_object_t* self = container_of(timeout, luv_object_t, h);
   ngx_queue_t* q;
   luv_state_t* s;
   ngx_queue_foreach(q, &self->rouse) {
     s = ngx_queue_data(q, luv_state_t, cond);
     TRACE("rouse %p\n", s);
     lua_settop(s->L, 0);
-    lua_pushinteger(s->L, status);
+    lua_pushinteger(s->L, 0);
   }
   luvL_cond_broadcast(&self->rouse);
 }
@@ -20,8 +218,8 @@ static int luv_new_timer(lua_State* L) {
   lua_setmetatable(L, -2);
 
   curr = luvL_state_self(L);
-  uv_timer_init(luvL_event_loop(L), &self->h.timer);
   luvL_object_init(curr, self);
+  luvL_timeout_init(&self->h.timeout, &luvL_thread_self(L)->wheel, _timer_cb);
 
   return 1;
 }
@@ -31,20 +229,32 @@ static int luv_timer_start(lua_State* L) {
   luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_TIMER_T);
   int64_t timeout = luaL_optlong(L, 2, 0L);
   int64_t repeat  = luaL_optlong(L, 3, 0L);
-  int rv = uv_timer_start(&self->h.timer, _timer_cb, timeout, repeat);
-  lua_pushinteger(L, rv);
+  luaL_argcheck(L, timeout >= 0, 2, "timeout must not be negative");
+  luaL_argcheck(L, repeat  >= 0, 3, "repeat must not be negative");
+  luvL_timeout_start(&self->h.timeout, (uint64_t)timeout, (uint64_t)repeat);
+  self->flags |= LUV_OSTARTED;
+  lua_pushinteger(L, 0);
   return 1;
 }
 
 static int luv_timer_again(lua_State* L) {
   luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_TIMER_T);
-  lua_pushinteger(L, uv_timer_again(&self->h.timer));
+  luv_timeout_t* timeout = &self->h.timeout;
+  if (!luvL_object_is_started(self)) {
+    lua_pushinteger(L, -1);
+    return 1;
+  }
+  if (timeout->repeat) {
+    luvL_timeout_start(timeout, timeout->repeat, timeout->repeat);
+  }
+  lua_pushinteger(L, 0);
   return 1;
 }
 
 static int luv_timer_stop(lua_State* L) {
   luv_object_t* self = (luv_object_t*)luaL_checkudata(L, 1, LUV_TIMER_T);
-  lua_pushinteger(L, uv_timer_stop(&self->h.timer));
+  luvL_timeout_stop(&self->h.timeout);
+  lua_pushinteger(L, 0);
   return 1;
 }
 
@@ -56,7 +266,7 @@ static int luv_timer_wait(lua_State *L) {
 
 static int luv_timer_free(lua_State *L) {
   luv_object_t* self = (luv_object_t*)lua_touserdata(L, 1);
-  luvL_object_close(self);
+  luvL_timeout_stop(&self->h.timeout);
   return 1;
 }
 static int luv_timer_tostring(lua_State *L) {